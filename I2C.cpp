@@ -35,7 +35,8 @@
   library.  Functions were rewritten to provide more functionality
   and also the use of Repeated Start.  Some I2C devices will not
   function correctly without the use of a Repeated Start.  The 
-  initial version of this library only supports the Master.
+  initial version of this library only supports the Master, a
+  register map slave can be compiled in with I2C_SLAVE.
 
 
   This library is free software; you can redistribute it and/or
@@ -53,7 +54,9 @@
   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
-#if (ARDUINO >= 100)
+#if I2C_HOST
+//I2C.h has the stand-ins of the Arduino core for the host build
+#elif (ARDUINO >= 100)
 #include <Arduino.h>
 #else
 #include <WProgram.h>
@@ -61,133 +64,688 @@
 
 #include <inttypes.h>
 #include "I2C.h"
+#if I2C_BACKEND == I2C_BACKEND_TWI
+#include <avr/pgmspace.h>
+#if I2C_SLEEP
+#include <avr/sleep.h>
+#endif
+#elif I2C_BACKEND == I2C_BACKEND_SAMD
+#include "wiring_private.h" //pinPeripheral()
+#endif
+
+#if I2C_BACKEND == I2C_BACKEND_TWI
+//The ATmega328PB headers only name the registers of its first TWI with a 0
+#if defined(TWCR0) && !defined(TWCR)
+#define TWBR TWBR0
+#define TWSR TWSR0
+#define TWAR TWAR0
+#define TWDR TWDR0
+#define TWCR TWCR0
+#define TWAMR TWAMR0
+#endif
+#if defined(TWI0_vect) && !defined(TWI_vect)
+#define TWI_vect TWI0_vect
+#endif
+
+//Register reg of the TWI this instance drives
+#if I2C_TWI_BUSES > 1
+#define TWI(reg) (*(bus ? &reg##1 : &reg))
+#else
+#define TWI(reg) reg
+#endif
+#undef TWI_STATUS
+#define TWI_STATUS (TWI(TWSR) & 0xF8)
+
+//Buffer of the reads without a dataBuffer, shared by the objects of a bus.
+//Kept out of the class so sizeof(I2C) doesn't depend on I2C_BUFFER_SIZE.
+#if I2C_BUFFER_SIZE
+static uint8_t defaultBuffer[I2C_TWI_BUSES][I2C_BUFFER_SIZE];
+#endif
+
+#if I2C_ASYNC || I2C_SLAVE || I2C_SLEEP
+//Instance each TWI_vect is handed to, the last one to enable the interrupt
+//on its bus: by starting an asynchronous transfer or slave, or sleeping
+static I2C *twiOwner[I2C_TWI_BUSES];
+#endif
+
+#if I2C_SLAVE
+//Instance answering as a slave on each TWI. Every stop and reset of the
+//master side keeps it listening, with TWEA for its address and TWIE.
+static I2C *slaveOwner[I2C_TWI_BUSES];
+#define SLAVE_LISTEN (slaveOwner[bus] ? (1 << TWEA) | (1 << TWIE) : 0)
+#else
+#define SLAVE_LISTEN 0
+#endif
+#else
+#if I2C_BUFFER_SIZE
+//a single SERCOM, or a host build, has one buffer for all objects
+static uint8_t defaultBuffer[1][I2C_BUFFER_SIZE];
+#endif
+#endif
+
+#if I2C_ASYNC || I2C_POLLED
+//States of the asynchronous transfer engine
+#define ASYNC_REGISTER 0
+#define ASYNC_WRITE 1
+#define ASYNC_READ 2
+#define ASYNC_READ_START 3
+//Or'ed into the starts of a transfer driven from TWI_vect, so a slave that
+//loses arbitration to a master addressing it still answers. The polled
+//engine leaves TWIE alone until its stop.
+#define ASYNC_LISTEN (asyncControl ? SLAVE_LISTEN : 0)
+#endif
+
+//Half an SCL period while the bus is clocked by hand (100kHz) and the
+//longest a slave may stretch one of those clocks, both in microseconds
+#define RECOVER_HALF_PERIOD 5
+#define RECOVER_STRETCH_LIMIT 1000
+
+#if I2C_BACKEND == I2C_BACKEND_TWI
+//Port and bits of SDA and SCL, used by pullup() and the bus recovery
+#if I2C_TWI_BUSES > 1
+// TWI1 of the atmega328pb is on PE0 (SDA1) and PE1 (SCL1)
+#define TWI_PORT (*(bus ? &PORTE : &PORTC))
+#define TWI_DDR (*(bus ? &DDRE : &DDRC))
+#define TWI_PINS (*(bus ? &PINE : &PINC))
+#define TWI_SDA (bus ? 0 : 4)
+#define TWI_SCL (bus ? 1 : 5)
+#elif defined(__AVR_ATmega168__) || defined(__AVR_ATmega8__) || defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328PB__)
+// as per note from atmega8 manual pg167
+#define TWI_PORT PORTC
+#define TWI_DDR DDRC
+#define TWI_PINS PINC
+#define TWI_SDA 4
+#define TWI_SCL 5
+#elif defined(__AVR_ATmega644__) || defined(__AVR_ATmega644P__)
+// as per note from atmega644p manual pg108
+#define TWI_PORT PORTC
+#define TWI_DDR DDRC
+#define TWI_PINS PINC
+#define TWI_SDA 1
+#define TWI_SCL 0
+#else
+// as per note from atmega128 manual pg204
+#define TWI_PORT PORTD
+#define TWI_DDR DDRD
+#define TWI_PINS PIND
+#define TWI_SDA 1
+#define TWI_SCL 0
+#endif
+#define TWI_LINES (_BV(TWI_SDA) | _BV(TWI_SCL))
+
+//Open-drain control of a bus line while the TWI is off: a low line is driven
+//by the port, a released one is left to the pull-ups
+void I2C::_lineLow(uint8_t line)
+{
+  cbi(TWI_PORT, line);
+  sbi(TWI_DDR, line);
+}
+
+void I2C::_lineRelease(uint8_t line, uint8_t pullups)
+{
+  cbi(TWI_DDR, line);
+  TWI_PORT |= pullups & _BV(line);
+}
+
+//Releases SCL and gives a stretching slave time to let go of it
+void I2C::_clockRelease(uint8_t pullups)
+{
+  _lineRelease(TWI_SCL, pullups);
+  for (uint16_t i = 0; (i < RECOVER_STRETCH_LIMIT) && !(TWI_PINS & _BV(TWI_SCL)); i++)
+  {
+    delayMicroseconds(1);
+  }
+  delayMicroseconds(RECOVER_HALF_PERIOD);
+}
+#endif
+
+#if I2C_SLAVE
+//States of the slave register map
+#define SLAVE_POINTER 0
+#define SLAVE_DATA 1
+#endif
+
+#if I2C_SAMPLER
+#if !defined(OCR2A)
+#error "I2C_SAMPLER needs Timer2 with OCR2A"
+#endif
+//samplerActive while no sampler read is running
+#define SAMPLER_IDLE 0xFF
+#endif
+
+#if I2C_WRITE_CACHE
+//cacheAddress of an unused entry, above every 7-bit address
+#define CACHE_FREE 0xFF
+#endif
+
+//A low-level method returns 1 on timeout, report it as the stage it was in
+static inline uint8_t timeOutStage(uint8_t status, uint8_t stage)
+{
+  return ((status == 1) ? stage : status);
+}
+
+//Lower bound of CPU cycles for one pass of a TWINT/TWSTO wait loop, used to
+//turn the timeout into a spin count so the loops never call millis()
+#define SPIN_CYCLES 10
+
+//Marks a bus phase boundary in the TWI low-level methods. A build can point
+//I2C_PHASE_HOOK at its own code, e.g. to toggle a debug pin for a logic
+//analyzer, I2C_PROFILE records TCNT1, otherwise it compiles to nothing.
+#if defined(I2C_PHASE_HOOK)
+#define PHASE(phase) I2C_PHASE_HOOK(phase)
+#elif I2C_PROFILE
+#define PHASE(phase) _profileMark(phase)
+#else
+#define PHASE(phase)
+#endif
 
-uint8_t I2C::bytesAvailable = 0;
-uint8_t I2C::bufferIndex = 0;
-uint8_t I2C::totalBytes = 0;
-uint16_t I2C::timeOutDelay = 0;
+//The byte _receiveByte() has just read, for the shared _transferPhases()
+#if I2C_BACKEND == I2C_BACKEND_TWI
+#define RECEIVED_BYTE TWI(TWDR)
+#else
+#define RECEIVED_BYTE lastByte
+#endif
 
-I2C::I2C()
+I2C::I2C(uint8_t twiBus)
 {
+#if I2C_BACKEND == I2C_BACKEND_TWI
+  bus = (twiBus < I2C_TWI_BUSES) ? twiBus : 0;
+#if I2C_SLEEP
+  sleepWaiting = 0;
+#endif
+#else
+  //one SERCOM is shared by every instance, a host instance is a bus of its own
+  (void)twiBus;
+#endif
+  bytesAvailable = 0;
+  bufferIndex = 0;
+  totalBytes = 0;
+  timeOutDelay = 0;
+  timeOutSpins = 0;
+  retryAttempts = 1;
+  retryBackoff = 0;
+  retryNack = 0;
+#if I2C_STATS
+  resetStats();
+#endif
+#if I2C_PROFILE
+  resetProfile();
+#endif
+#if I2C_TRACE
+  resetTrace();
+#endif
+#if I2C_WRITE_CACHE
+  invalidateCache();
+#endif
+#if I2C_PRESENCE
+  presenceLimit = 0;
+  presenceInterval = 0;
+  resetPresence();
+#endif
+#if I2C_MUX_DEVICES
+  muxCount = 0;
+#endif
+#if I2C_SMBUS
+  smbusPec = 0;
+  smbusCount = 0;
+#endif
+#if I2C_BUFFER_SIZE
+#if I2C_BACKEND == I2C_BACKEND_TWI
+  data = defaultBuffer[bus];
+#else
+  data = defaultBuffer[0];
+#endif
+  bufferSize = I2C_BUFFER_SIZE;
+#else
+  data = NULL;
+  bufferSize = 0;
+#endif
+#if I2C_ASYNC || I2C_POLLED
+  asyncStatus = 0;
+#endif
+#if I2C_SAMPLER
+  samplerCount = 0;
+  samplerActive = SAMPLER_IDLE;
+#endif
+#if I2C_BACKEND == I2C_BACKEND_SAMD
+  clockRate = 100000;
+  baud = 0;
+  lastByte = 0;
+  rxPending = 0;
+  dmaReady = 0;
+  pullups = 0;
+#endif
+#if I2C_BACKEND == I2C_BACKEND_HOST
+  models = NULL;
+  current = NULL;
+  reading = 0;
+  lastByte = 0;
+  clockRate = 100000;
+  resetBusCounters();
+#endif
 }
 
 ////////////// Public Methods ////////////////////////////////////////
 
+#if I2C_BACKEND == I2C_BACKEND_TWI
 void I2C::begin()
 {
   pullup(1);
 
   // initialize twi prescaler and bit rate
-  cbi(TWSR, TWPS0);
-  cbi(TWSR, TWPS1);
-  TWBR = ((F_CPU / 100000) - 16) / 2;
+  setClock(100000);
   // enable twi module and acks
-  TWCR = _BV(TWEN) | _BV(TWEA);
+  TWI(TWCR) = _BV(TWEN) | _BV(TWEA);
 }
 
 void I2C::end()
 {
-  TWCR = 0;
+  TWI(TWCR) = 0;
 }
+#endif
 
 void I2C::timeOut(uint16_t _timeOut)
+{
+  timeOutMicros((uint32_t)_timeOut * 1000);
+}
+
+void I2C::timeOutMicros(uint32_t _timeOut)
 {
   timeOutDelay = _timeOut;
+  _updateTimeOut();
+}
+
+//attempts counts the first try, so 1 turns the retries off
+void I2C::setRetries(uint8_t attempts, uint16_t backoffMicros, uint8_t onNack)
+{
+  retryAttempts = attempts ? attempts : 1;
+  retryBackoff = backoffMicros;
+  retryNack = onNack;
 }
 
 void I2C::setSpeed(uint8_t _fast)
 {
   if (!_fast)
   {
-    TWBR = ((F_CPU / 100000) - 16) / 2;
+    setClock(100000);
   }
   else
   {
-    TWBR = ((F_CPU / 400000) - 16) / 2;
+    setClock(400000);
+  }
+}
+
+#if I2C_BACKEND == I2C_BACKEND_TWI
+//Picks the smallest prescaler that can reach the requested clock and rounds
+//TWBR up so the bus is never run faster than asked. Returns the actual rate.
+uint32_t I2C::setClock(uint32_t hz)
+{
+  if (!hz)
+  {
+    hz = 1;
   }
+  uint8_t prescaler = _clockPrescaler(hz);
+  uint32_t bitRate = _clockTWBR(hz, prescaler);
+  if (bitRate > 0xFF)
+  {
+    bitRate = 0xFF;
+  }
+  _setClock(bitRate, prescaler);
+  return (_clockRate(bitRate, prescaler));
 }
 
 void I2C::pullup(uint8_t activate)
 {
   if (activate)
   {
-#if defined(__AVR_ATmega168__) || defined(__AVR_ATmega8__) || defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328PB__)
-    // activate internal pull-ups for twi
-    // as per note from atmega8 manual pg167
-    sbi(PORTC, 4);
-    sbi(PORTC, 5);
-#elif defined(__AVR_ATmega644__) || defined(__AVR_ATmega644P__)
     // activate internal pull-ups for twi
-    // as per note from atmega644p manual pg108
-    sbi(PORTC, 0);
-    sbi(PORTC, 1);
-#else
-    // activate internal pull-ups for twi
-    // as per note from atmega128 manual pg204
-    sbi(PORTD, 0);
-    sbi(PORTD, 1);
-#endif
+    sbi(TWI_PORT, TWI_SDA);
+    sbi(TWI_PORT, TWI_SCL);
   }
   else
   {
-#if defined(__AVR_ATmega168__) || defined(__AVR_ATmega8__) || defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328PB__)
-    // deactivate internal pull-ups for twi
-    // as per note from atmega8 manual pg167
-    cbi(PORTC, 4);
-    cbi(PORTC, 5);
-#elif defined(__AVR_ATmega644__) || defined(__AVR_ATmega644P__)
-    // deactivate internal pull-ups for twi
-    // as per note from atmega644p manual pg108
-    cbi(PORTC, 0);
-    cbi(PORTC, 1);
-#else
     // deactivate internal pull-ups for twi
-    // as per note from atmega128 manual pg204
-    cbi(PORTD, 0);
-    cbi(PORTD, 1);
-#endif
+    cbi(TWI_PORT, TWI_SDA);
+    cbi(TWI_PORT, TWI_SCL);
   }
 }
+#endif
 
 void I2C::scan()
 {
-  uint16_t tempTime = timeOutDelay;
-  timeOut(80);
-  uint8_t totalDevicesFound = 0;
+  uint8_t found[16];
   Serial.println(F("Scanning for devices...please wait"));
   Serial.println();
+  uint8_t totalDevicesFound = scan(found, 80000);
   for (uint8_t s = 0; s <= 0x7F; s++)
   {
-    returnStatus = 0;
+    if (found[s >> 3] & (1 << (s & 0x07)))
+    {
+      Serial.print(F("Found device at address - "));
+      Serial.print(F(" 0x"));
+      Serial.println(s, HEX);
+    }
+  }
+  if (totalDevicesFound == 0xFF)
+  {
+    Serial.println(F("There is a problem with the bus, could not complete scan"));
+    return;
+  }
+  if (!totalDevicesFound)
+  {
+    Serial.println(F("No devices found"));
+  }
+}
+
+//Sets bit (address & 7) of bitmap[address >> 3] for every address from first
+//to last that ACKs. timeOut (in microseconds) only applies during the scan.
+//Returns the number of devices found or 0xFF if the bus stopped responding.
+uint8_t I2C::scan(uint8_t *bitmap, uint32_t timeOut, uint8_t first, uint8_t last)
+{
+  uint32_t tempTime = timeOutDelay;
+  timeOutMicros(timeOut);
+  memset(bitmap, 0, 16);
+  uint8_t totalDevicesFound = 0;
+  for (uint8_t s = first; (s <= last) && (s <= 0x7F); s++)
+  {
     returnStatus = _start();
     if (!returnStatus)
     {
       returnStatus = _sendAddress(SLA_W(s));
-    }
-    if (returnStatus)
-    {
-      if (returnStatus == 1)
+      if (!returnStatus)
       {
-        Serial.println(F("There is a problem with the bus, could not complete scan"));
-        timeOutDelay = tempTime;
-        return;
+        bitmap[s >> 3] |= 1 << (s & 0x07);
+        totalDevicesFound++;
+#if I2C_PRESENCE
+        _presenceUpdate(s, 0);
+#endif
+        returnStatus = _stop();
       }
     }
-    else
+    else if (returnStatus != 1)
     {
-      Serial.print(F("Found device at address - "));
-      Serial.print(F(" 0x"));
-      Serial.println(s, HEX);
-      totalDevicesFound++;
+      _stop();
+    }
+    if (returnStatus == 1)
+    {
+      totalDevicesFound = 0xFF;
+      break;
     }
-    _stop();
   }
-  if (!totalDevicesFound)
+  timeOutMicros(tempTime);
+  return (totalDevicesFound);
+}
+
+//Replaces the internal buffer, e.g. with a bigger one for bulk reads
+void I2C::setBuffer(uint8_t *buffer, uint8_t size)
+{
+  data = buffer;
+  bufferSize = buffer ? size : 0;
+  bytesAvailable = 0;
+  bufferIndex = 0;
+}
+
+#if I2C_STATS
+const I2CStats &I2C::stats()
+{
+  return (statistics);
+}
+
+void I2C::resetStats()
+{
+  memset(&statistics, 0, sizeof(statistics));
+  statistics.minMicros = 0xFFFFFFFF;
+}
+#endif
+
+#if I2C_TRACE
+//Copies up to max entries into dest, oldest first, and returns how many
+uint8_t I2C::trace(I2CTraceEntry *dest, uint8_t max)
+{
+  uint8_t count = (traceCount < max) ? traceCount : max;
+  uint8_t index = (traceHead + I2C_TRACE_SIZE - traceCount) % I2C_TRACE_SIZE;
+  for (uint8_t i = 0; i < count; i++)
   {
-    Serial.println(F("No devices found"));
+    dest[i] = traceRing[index];
+    index = (index + 1 < I2C_TRACE_SIZE) ? index + 1 : 0;
+  }
+  return (count);
+}
+
+void I2C::resetTrace()
+{
+  traceHead = 0;
+  traceCount = 0;
+}
+
+//Sends the ring oldest first as "I2T", a version byte, the entry count and
+//the entry size, then 10 bytes per entry: time (4), address, status,
+//registerAddress (2), length (2), all little-endian. The layout is fixed so
+//the same decoder works for every board.
+void I2C::dumpTrace(Print &out)
+{
+  const uint8_t header[6] = {'I', '2', 'T', 1, traceCount, 10};
+  out.write(header, sizeof(header));
+  uint8_t index = (traceHead + I2C_TRACE_SIZE - traceCount) % I2C_TRACE_SIZE;
+  for (uint8_t i = 0; i < traceCount; i++)
+  {
+    const I2CTraceEntry &entry = traceRing[index];
+    uint8_t packed[10];
+    packed[0] = entry.time;
+    packed[1] = entry.time >> 8;
+    packed[2] = entry.time >> 16;
+    packed[3] = entry.time >> 24;
+    packed[4] = entry.address;
+    packed[5] = entry.status;
+    packed[6] = entry.registerAddress;
+    packed[7] = entry.registerAddress >> 8;
+    packed[8] = entry.length;
+    packed[9] = entry.length >> 8;
+    out.write(packed, sizeof(packed));
+    index = (index + 1 < I2C_TRACE_SIZE) ? index + 1 : 0;
+  }
+}
+
+//Called by _transfer() for every attempt, read is or'ed into the address
+void I2C::_traceTransfer(uint8_t address, uint16_t registerAddress, uint16_t length, uint8_t status)
+{
+  I2CTraceEntry &entry = traceRing[traceHead];
+  entry.time = millis();
+  entry.address = address;
+  entry.status = status;
+  entry.registerAddress = registerAddress;
+  entry.length = length;
+  traceHead = (traceHead + 1 < I2C_TRACE_SIZE) ? traceHead + 1 : 0;
+  if (traceCount < I2C_TRACE_SIZE)
+  {
+    traceCount++;
+  }
+}
+#endif
+
+#if I2C_PRESENCE
+//Off until called. A device that has gone absent costs a table lookup per
+//call, every probeMillis one call is let through to check whether it is
+//back. Any ACK of its address (I2c.scan() included) makes it present again.
+void I2C::setPresence(uint8_t nacks, uint16_t probeMillis)
+{
+  presenceLimit = nacks;
+  presenceInterval = probeMillis;
+  resetPresence();
+}
+
+void I2C::resetPresence()
+{
+  memset(presenceNacks, 0, sizeof(presenceNacks));
+}
+
+uint8_t I2C::absent(uint8_t address)
+{
+  uint8_t entry = _presenceFind(address);
+  return (presenceLimit && (entry < I2C_PRESENCE) && (presenceNacks[entry] >= presenceLimit));
+}
+
+//Returns the number of absent devices, mux handles are only seen by absent()
+uint8_t I2C::absentDevices(uint8_t *bitmap)
+{
+  memset(bitmap, 0, 16);
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < I2C_PRESENCE; i++)
+  {
+    if (presenceLimit && (presenceNacks[i] >= presenceLimit) && !(presenceAddress[i] & 0x80))
+    {
+      bitmap[presenceAddress[i] >> 3] |= 1 << (presenceAddress[i] & 0x07);
+      count++;
+    }
+  }
+  return (count);
+}
+#endif
+
+#if I2C_MUX_DEVICES
+//The returned address works with every blocking call (I2CDevice too, the
+//addresses are handed out in order). The mux is only written when the
+//channel changes, other muxes are closed first so identical devices behind
+//different muxes never see the bus at the same time.
+uint8_t I2C::addMuxDevice(I2CMux *mux, uint8_t channel, uint8_t address)
+{
+  if ((muxCount >= I2C_MUX_DEVICES) || (channel > 7))
+  {
+    return (0);
+  }
+  muxOf[muxCount] = mux;
+  muxChannel[muxCount] = channel;
+  muxAddress[muxCount] = address;
+  return (0x80 | muxCount++);
+}
+
+void I2C::removeMuxDevices()
+{
+  muxCount = 0;
+}
+#endif
+
+#if I2C_WRITE_CACHE
+//Call after the device was reset or power cycled, or was written behind the
+//library's back, so the next writes go out on the bus again
+void I2C::invalidateCache(uint8_t address)
+{
+  _cacheForget(address, 0, 0x100);
+}
+
+void I2C::invalidateCache()
+{
+  memset(cacheAddress, CACHE_FREE, sizeof(cacheAddress));
+  cacheNext = 0;
+}
+
+//Returns the entry holding registerAddress of address or I2C_WRITE_CACHE
+uint8_t I2C::_cacheFind(uint8_t address, uint8_t registerAddress)
+{
+  for (uint8_t i = 0; i < I2C_WRITE_CACHE; i++)
+  {
+    if ((cacheAddress[i] == address) && (cacheRegister[i] == registerAddress))
+    {
+      return (i);
+    }
+  }
+  return (I2C_WRITE_CACHE);
+}
+
+//Keeps value in entry, or in a free one (the oldest if none is) for a miss
+void I2C::_cacheStore(uint8_t entry, uint8_t address, uint8_t registerAddress, uint8_t value)
+{
+  if (entry >= I2C_WRITE_CACHE)
+  {
+    for (entry = 0; (entry < I2C_WRITE_CACHE) && (cacheAddress[entry] != CACHE_FREE); entry++)
+      ;
+    if (entry >= I2C_WRITE_CACHE)
+    {
+      entry = cacheNext;
+      cacheNext = (cacheNext + 1 < I2C_WRITE_CACHE) ? cacheNext + 1 : 0;
+    }
+  }
+  cacheAddress[entry] = address;
+  cacheRegister[entry] = registerAddress;
+  cacheValue[entry] = value;
+}
+
+//Drops the count registers from first on (wrapping like the register
+//pointer), whatever writes them leaves their value unknown until it succeeds
+void I2C::_cacheForget(uint8_t address, uint8_t first, uint16_t count)
+{
+  for (uint8_t i = 0; i < I2C_WRITE_CACHE; i++)
+  {
+    if ((cacheAddress[i] == address) && ((uint8_t)(cacheRegister[i] - first) < count))
+    {
+      cacheAddress[i] = CACHE_FREE;
+    }
+  }
+}
+#endif
+
+#if I2C_PROFILE
+//Copies up to max entries into dest, oldest first, and returns how many
+uint8_t I2C::profile(I2CProfileEntry *dest, uint8_t max)
+{
+  uint8_t count = (profileCount < max) ? profileCount : max;
+  uint8_t index = (profileHead + I2C_PROFILE_SIZE - profileCount) % I2C_PROFILE_SIZE;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    dest[i] = profileRing[index];
+    index = (index + 1 < I2C_PROFILE_SIZE) ? index + 1 : 0;
+  }
+  return (count);
+}
+
+void I2C::resetProfile()
+{
+  profileHead = 0;
+  profileCount = 0;
+}
+#endif
+
+#if I2C_BACKEND == I2C_BACKEND_TWI
+//A slave that was reset or glitched halfway through a byte keeps driving
+//SDA low until it has clocked out the rest of it. SCL is toggled by hand
+//(at most 9 times, a byte and its ACK) until SDA is released, then a STOP
+//is sent so every slave is back to idle and the TWI is re-enabled.
+uint8_t I2C::recoverBus()
+{
+  uint8_t pullups = TWI_PORT & TWI_LINES;
+  TWI(TWCR) = 0;
+  _lineRelease(TWI_SDA, pullups);
+  _clockRelease(pullups);
+  //nothing can be clocked out while a slave holds SCL itself
+  if (TWI_PINS & _BV(TWI_SCL))
+  {
+    for (uint8_t i = 0; (i < 9) && !(TWI_PINS & _BV(TWI_SDA)); i++)
+    {
+      _lineLow(TWI_SCL);
+      delayMicroseconds(RECOVER_HALF_PERIOD);
+      _clockRelease(pullups);
+    }
+    //STOP: SDA rises while SCL is high
+    _lineLow(TWI_SCL);
+    delayMicroseconds(RECOVER_HALF_PERIOD);
+    _lineLow(TWI_SDA);
+    delayMicroseconds(RECOVER_HALF_PERIOD);
+    _clockRelease(pullups);
+    _lineRelease(TWI_SDA, pullups);
+    delayMicroseconds(RECOVER_HALF_PERIOD);
+  }
+  uint8_t held = ((TWI_PINS & TWI_LINES) != TWI_LINES);
+#if I2C_STATS
+  statistics.recoveries++;
+  if (held)
+  {
+    statistics.recoverFails++;
   }
-  timeOutDelay = tempTime;
+#endif
+  TWI(TWCR) = _BV(TWEN) | _BV(TWEA) | SLAVE_LISTEN;
+  return (held);
 }
+#endif
 
 uint8_t I2C::available()
 {
@@ -196,14 +754,13 @@ uint8_t I2C::available()
 
 uint8_t I2C::receive()
 {
-  bufferIndex = totalBytes - bytesAvailable;
   if (!bytesAvailable)
   {
     bufferIndex = 0;
     return (0);
   }
   bytesAvailable--;
-  return (data[bufferIndex]);
+  return (data[bufferIndex++]);
 }
 
 /*return values for new functions that use the timeOut feature 
@@ -229,40 +786,7 @@ uint8_t I2C::receive()
 
 uint8_t I2C::write(uint8_t address, uint8_t registerAddress)
 {
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendByte(registerAddress);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
-  }
-  return (returnStatus);
+  return (_transfer(address, registerAddress, 1, NULL, 0, NULL, 0, TRANSFER_STOP));
 }
 
 uint8_t I2C::write(int address, int registerAddress)
@@ -272,49 +796,24 @@ uint8_t I2C::write(int address, int registerAddress)
 
 uint8_t I2C::write(uint8_t address, uint8_t registerAddress, uint8_t data)
 {
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
+#if I2C_WRITE_CACHE
+  //the buffer overload below is never skipped, for registers written for
+  //their side effect
+  uint8_t entry = _cacheFind(address, registerAddress);
+  if ((entry < I2C_WRITE_CACHE) && (cacheValue[entry] == data))
   {
-    return (returnStatus);
+    returnStatus = 0;
+    return (0);
   }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendByte(registerAddress);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendByte(data);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _stop();
-  if (returnStatus)
+  returnStatus = _transfer(address, registerAddress, 1, &data, 1, NULL, 0, TRANSFER_STOP);
+  if (!returnStatus)
   {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
+    _cacheStore(entry, address, registerAddress, data);
   }
   return (returnStatus);
+#else
+  return (_transfer(address, registerAddress, 1, &data, 1, NULL, 0, TRANSFER_STOP));
+#endif
 }
 
 uint8_t I2C::write(int address, int registerAddress, int data)
@@ -324,45 +823,37 @@ uint8_t I2C::write(int address, int registerAddress, int data)
 
 uint8_t I2C::write(uint8_t address, uint8_t registerAddress, const char *data)
 {
-  uint8_t bufferLength = strlen(data);
-  returnStatus = 0;
-  returnStatus = write(address, registerAddress, (const uint8_t *)data, bufferLength);
-  return (returnStatus);
+  return (_transfer(address, registerAddress, 1, (const uint8_t *)data, strlen(data), NULL, 0, TRANSFER_STOP));
 }
 
 uint8_t I2C::write(uint8_t address, uint8_t registerAddress, uint16_t data)
 {
   //Array to hold the 2 bytes that will be written to the register
   uint8_t writeBytes[2];
-  returnStatus = 0;
 
   writeBytes[0] = (data >> 8) & 0xFF; //MSB
   writeBytes[1] = data & 0xFF;        //LSB
 
-  returnStatus = write(address, registerAddress, writeBytes, 2);
-  return (returnStatus);
+  return (write(address, registerAddress, writeBytes, 2));
 }
 
 uint8_t I2C::write(uint8_t address, uint8_t registerAddress, uint32_t data)
 {
   //Array to hold the 4 bytes that will be written to the register
   uint8_t writeBytes[4];
-  returnStatus = 0;
 
   writeBytes[0] = (data >> 24) & 0xFF; //MSB
   writeBytes[1] = (data >> 16) & 0xFF;
   writeBytes[2] = (data >> 8) & 0xFF;
   writeBytes[3] = data & 0xFF; //LSB
 
-  returnStatus = write(address, registerAddress, writeBytes, 4);
-  return (returnStatus);
+  return (write(address, registerAddress, writeBytes, 4));
 }
 
 uint8_t I2C::write(uint8_t address, uint8_t registerAddress, uint64_t data)
 {
   //Array to hold the 8 bytes that will be written to the register
   uint8_t writeBytes[8];
-  returnStatus = 0;
 
   writeBytes[0] = (data >> 56) & 0xFF; //MSB
   writeBytes[1] = (data >> 48) & 0xFF;
@@ -373,1163 +864,2591 @@ uint8_t I2C::write(uint8_t address, uint8_t registerAddress, uint64_t data)
   writeBytes[6] = (data >> 8) & 0xFF;
   writeBytes[7] = data & 0xFF; //LSB
 
-  returnStatus = write(address, registerAddress, writeBytes, 8);
-  return (returnStatus);
+  return (write(address, registerAddress, writeBytes, 8));
 }
 
 uint8_t I2C::write(uint8_t address, uint8_t registerAddress, const uint8_t *data, uint8_t numberBytes)
 {
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendByte(registerAddress);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  for (uint8_t i = 0; i < numberBytes; i++)
+  return (_transfer(address, registerAddress, 1, data, numberBytes, NULL, 0, TRANSFER_STOP));
+}
+
+#if (ARDUINO >= 100)
+uint8_t I2C::write(uint8_t address, uint8_t registerAddress, const __FlashStringHelper *data)
+{
+  const uint8_t *flash = (const uint8_t *)data;
+  return (_transfer(address, registerAddress, 1, flash, strlen_P((const char *)flash), NULL, 0, TRANSFER_STOP | TRANSFER_FLASH));
+}
+#endif
+
+uint8_t I2C::write_P(uint8_t address, uint8_t registerAddress, const uint8_t *data, uint16_t numberBytes)
+{
+  return (_transfer(address, registerAddress, 1, data, numberBytes, NULL, 0, TRANSFER_STOP | TRANSFER_FLASH));
+}
+
+uint8_t I2C::read(int address, int numberBytes)
+{
+  return (read((uint8_t)address, (uint8_t)numberBytes));
+}
+
+uint8_t I2C::read(uint8_t address, uint8_t numberBytes)
+{
+  if (!bufferSize)
   {
-    returnStatus = _sendByte(data[i]);
-    if (returnStatus)
-    {
-      if (returnStatus == 1)
-      {
-        return (3);
-      }
-      return (returnStatus);
-    }
+    return (I2C_NO_BUFFER);
   }
-  returnStatus = _stop();
-  if (returnStatus)
+  numberBytes = min(numberBytes, bufferSize);
+  return (readex(address, (uint16_t)numberBytes, data));
+}
+
+uint8_t I2C::read(int address, int registerAddress, int numberBytes)
+{
+  return (read((uint8_t)address, (uint8_t)registerAddress, (uint8_t)numberBytes));
+}
+
+uint8_t I2C::read(uint8_t address, uint8_t registerAddress, uint8_t numberBytes)
+{
+  if (!bufferSize)
   {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
+    return (I2C_NO_BUFFER);
   }
-  return (returnStatus);
+  numberBytes = min(numberBytes, bufferSize);
+  return (readex(address, registerAddress, (uint16_t)numberBytes, data));
 }
 
-uint8_t I2C::read(int address, int numberBytes)
+uint8_t I2C::read(uint8_t address, uint8_t numberBytes, uint8_t *dataBuffer)
 {
-  return (read((uint8_t)address, (uint8_t)numberBytes));
+  return (readex(address, (uint16_t)numberBytes, dataBuffer));
 }
 
-uint8_t I2C::read(uint8_t address, uint8_t numberBytes)
+uint8_t I2C::readex(uint8_t address, uint16_t numberBytes, uint8_t *dataBuffer)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  numberBytes = min(numberBytes, MAX_BUFFER_SIZE);
   if (numberBytes == 0)
   {
     numberBytes++;
   }
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
+  return (_transfer(address, 0, 0, NULL, 0, dataBuffer, numberBytes, TRANSFER_STOP));
+}
+
+uint8_t I2C::read(uint8_t address, uint8_t registerAddress, uint8_t numberBytes, uint8_t *dataBuffer)
+{
+  return (readex(address, registerAddress, (uint16_t)numberBytes, dataBuffer));
+}
+
+uint8_t I2C::readex(uint8_t address, uint8_t registerAddress, uint16_t numberBytes, uint8_t *dataBuffer)
+{
+  if (numberBytes == 0)
   {
-    return (returnStatus);
+    numberBytes++;
   }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
+  return (_transfer(address, registerAddress, 1, NULL, 0, dataBuffer, numberBytes, TRANSFER_STOP));
+}
+
+uint8_t I2C::readStream(uint8_t address, uint8_t registerAddress, uint16_t numberBytes, uint8_t *chunk, uint8_t chunkSize, I2CChunkCallback callback)
+{
+  return (_stream(address, registerAddress, 1, numberBytes, chunk, chunkSize, callback));
+}
+
+//For command prefixes that don't fit registerAddress (3-byte flash
+//addresses, command plus arguments). With txLen 0 it is a plain read, with
+//rxLen 0 a plain write, with both 0 an address-only probe.
+uint8_t I2C::transfer(uint8_t address, const uint8_t *txData, uint16_t txLen, uint8_t *rxData, uint16_t rxLen)
+{
+  if (!rxData)
   {
-    if (returnStatus == 1)
+    if (rxLen && !bufferSize)
     {
-      return (5);
+      return (I2C_NO_BUFFER);
     }
-    return (returnStatus);
+    rxData = data;
+    rxLen = min(rxLen, bufferSize);
   }
-  for (uint8_t i = 0; i < numberBytes; i++)
+  return (_transfer(address, 0, 0, txData, txLen, rxData, rxLen, TRANSFER_STOP));
+}
+
+#if I2C_SMBUS
+////////// SMBus Methods ///////////
+
+//Off by default. The PEC covers every byte of the transaction, address
+//bytes included, and is sent after a write or checked after a read.
+void I2C::setPec(uint8_t enable)
+{
+  smbusPec = enable ? TRANSFER_PEC : 0;
+}
+
+uint8_t I2C::smbusBlockWrite(uint8_t address, uint8_t command, const uint8_t *data, uint8_t count)
+{
+  return (_transfer(address, command, 1, data, count, NULL, 0, TRANSFER_STOP | TRANSFER_BLOCK_WRITE | smbusPec));
+}
+
+//The count byte from the slave decides how many bytes are read, in the same
+//transaction, so no second read() is needed
+uint8_t I2C::smbusBlockRead(uint8_t address, uint8_t command, uint8_t *data, uint8_t maxCount, uint8_t *count)
+{
+  smbusCount = 0;
+  returnStatus = _transfer(address, command, 1, NULL, 0, data, maxCount, TRANSFER_STOP | TRANSFER_BLOCK_READ | smbusPec);
+  if (count)
   {
-    if (i == nack)
-    {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
+    *count = smbusCount;
+  }
+  return (returnStatus);
+}
 
-      if (returnStatus != MR_DATA_NACK)
-      {
-        return (returnStatus);
-      }
-    }
-    else
-    {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_ACK)
-      {
-        return (returnStatus);
-      }
-    }
-    data[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
+//Sends data and reads the reply, both as SMBus words (LSB first)
+uint8_t I2C::smbusProcessCall(uint8_t address, uint8_t command, uint16_t data, uint16_t *reply)
+{
+  uint8_t writeBytes[2] = {(uint8_t)(data & 0xFF), (uint8_t)(data >> 8)};
+  uint8_t readBytes[2];
+  returnStatus = _transfer(address, command, 1, writeBytes, 2, readBytes, 2, TRANSFER_STOP | smbusPec);
+  if (!returnStatus)
+  {
+    *reply = readBytes[0] | (readBytes[1] << 8);
   }
-  returnStatus = _stop();
-  if (returnStatus)
+  return (returnStatus);
+}
+
+uint8_t I2C::smbusBlockProcessCall(uint8_t address, uint8_t command, const uint8_t *data, uint8_t count, uint8_t *reply, uint8_t maxCount, uint8_t *replyCount)
+{
+  smbusCount = 0;
+  returnStatus = _transfer(address, command, 1, data, count, reply, maxCount, TRANSFER_STOP | TRANSFER_BLOCK_WRITE | TRANSFER_BLOCK_READ | smbusPec);
+  if (replyCount)
   {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
+    *replyCount = smbusCount;
   }
   return (returnStatus);
 }
+#endif
 
-uint8_t I2C::read(int address, int registerAddress, int numberBytes)
+////////// 16-Bit Methods ///////////
+
+//These functions will be used to write to Slaves that take 16-bit addresses
+uint8_t I2C::write16(uint8_t address, uint16_t registerAddress)
 {
-  return (read((uint8_t)address, (uint8_t)registerAddress, (uint8_t)numberBytes));
+  return (_transfer(address, registerAddress, 2, NULL, 0, NULL, 0, TRANSFER_STOP));
+}
+uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, uint8_t data)
+{
+  return (_transfer(address, registerAddress, 2, &data, 1, NULL, 0, TRANSFER_STOP));
+}
+uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, const char *data)
+{
+  return (_transfer(address, registerAddress, 2, (const uint8_t *)data, strlen(data), NULL, 0, TRANSFER_STOP));
+}
+uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, const uint8_t *data, uint8_t numberBytes)
+{
+  return (_transfer(address, registerAddress, 2, data, numberBytes, NULL, 0, TRANSFER_STOP));
 }
 
-uint8_t I2C::read(uint8_t address, uint8_t registerAddress, uint8_t numberBytes)
+#if (ARDUINO >= 100)
+uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, const __FlashStringHelper *data)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  numberBytes = min(numberBytes, MAX_BUFFER_SIZE);
-  if (numberBytes == 0)
+  const uint8_t *flash = (const uint8_t *)data;
+  return (_transfer(address, registerAddress, 2, flash, strlen_P((const char *)flash), NULL, 0, TRANSFER_STOP | TRANSFER_FLASH));
+}
+#endif
+
+uint8_t I2C::write16_P(uint8_t address, uint16_t registerAddress, const uint8_t *data, uint16_t numberBytes)
+{
+  return (_transfer(address, registerAddress, 2, data, numberBytes, NULL, 0, TRANSFER_STOP | TRANSFER_FLASH));
+}
+uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, uint16_t data)
+{
+  //Array to hold the 2 bytes that will be written to the register
+  uint8_t writeBytes[2];
+
+  writeBytes[0] = (data >> 8) & 0xFF; //MSB
+  writeBytes[1] = data & 0xFF;        //LSB
+
+  return (write16(address, registerAddress, writeBytes, 2));
+}
+
+uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, uint32_t data)
+{
+  //Array to hold the 4 bytes that will be written to the register
+  uint8_t writeBytes[4];
+
+  writeBytes[0] = (data >> 24) & 0xFF; //MSB
+  writeBytes[1] = (data >> 16) & 0xFF;
+  writeBytes[2] = (data >> 8) & 0xFF;
+  writeBytes[3] = data & 0xFF; //LSB
+
+  return (write16(address, registerAddress, writeBytes, 4));
+}
+
+uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, uint64_t data)
+{
+  //Array to hold the 8 bytes that will be written to the register
+  uint8_t writeBytes[8];
+
+  writeBytes[0] = (data >> 56) & 0xFF; //MSB
+  writeBytes[1] = (data >> 48) & 0xFF;
+  writeBytes[2] = (data >> 40) & 0xFF;
+  writeBytes[3] = (data >> 32) & 0xFF;
+  writeBytes[4] = (data >> 24) & 0xFF;
+  writeBytes[5] = (data >> 16) & 0xFF;
+  writeBytes[6] = (data >> 8) & 0xFF;
+  writeBytes[7] = data & 0xFF; //LSB
+
+  return (write16(address, registerAddress, writeBytes, 8));
+}
+//These functions will be used to read from Slaves that take 16-bit addresses
+uint8_t I2C::read16(uint8_t address, uint16_t registerAddress, uint8_t numberBytes)
+{
+  if (!bufferSize)
   {
-    numberBytes++;
+    return (I2C_NO_BUFFER);
   }
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
+  numberBytes = min(numberBytes, bufferSize);
+  return (read16ex(address, registerAddress, (uint16_t)numberBytes, data));
+}
+uint8_t I2C::read16(uint8_t address, uint16_t registerAddress, uint8_t numberBytes, uint8_t *dataBuffer)
+{
+  return (read16ex(address, registerAddress, (uint16_t)numberBytes, dataBuffer));
+}
+uint8_t I2C::read16ex(uint8_t address, uint16_t registerAddress, uint16_t numberBytes, uint8_t *dataBuffer)
+{
+  if (numberBytes == 0)
   {
-    return (returnStatus);
+    numberBytes++;
   }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
+  return (_transfer(address, registerAddress, 2, NULL, 0, dataBuffer, numberBytes, TRANSFER_STOP));
+}
+
+uint8_t I2C::readStream16(uint8_t address, uint16_t registerAddress, uint16_t numberBytes, uint8_t *chunk, uint8_t chunkSize, I2CChunkCallback callback)
+{
+  return (_stream(address, registerAddress, 2, numberBytes, chunk, chunkSize, callback));
+}
+
+//Writes numberBytes to an EEPROM with 16-bit memory addresses, one page at
+//a time. Instead of a fixed delay the device is polled after each page
+//until it acknowledges its address again, i.e. the write cycle is over.
+//A pageSize of 0 sends everything in one transaction.
+uint8_t I2C::writeEeprom(uint8_t address, uint16_t memoryAddress, const uint8_t *data, uint16_t numberBytes, uint16_t pageSize)
+{
+  while (numberBytes)
   {
-    if (returnStatus == 1)
+    uint16_t chunk = numberBytes;
+    if (pageSize)
     {
-      return (2);
+      chunk = pageSize - (memoryAddress % pageSize);
+      if (chunk > numberBytes)
+      {
+        chunk = numberBytes;
+      }
     }
-    return (returnStatus);
-  }
-  returnStatus = _sendByte(registerAddress);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
+    returnStatus = _transfer(address, memoryAddress, 2, data, chunk, NULL, 0, TRANSFER_STOP);
+    if (returnStatus)
     {
-      return (3);
+      return (returnStatus);
     }
-    return (returnStatus);
-  }
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
+    returnStatus = _ackPoll(address);
+    if (returnStatus)
     {
-      return (4);
+      return (returnStatus);
     }
-    return (returnStatus);
+    memoryAddress += chunk;
+    data += chunk;
+    numberBytes -= chunk;
   }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
+  return (0);
+}
+
+//Writes a PROGMEM table of {register, value} pairs, one register per pair,
+//chained with repeated starts and a single stop at the end
+uint8_t I2C::writeTable(uint8_t address, const uint8_t *table, uint16_t tableSize)
+{
+  uint8_t flags = TRANSFER_FLASH;
+  for (uint16_t i = 0; i + 1 < tableSize; i += 2)
   {
-    if (returnStatus == 1)
+    if (i + 3 >= tableSize)
     {
-      return (5);
+      flags |= TRANSFER_STOP;
     }
-    return (returnStatus);
-  }
-  for (uint8_t i = 0; i < numberBytes; i++)
-  {
-    if (i == nack)
+    returnStatus = _transfer(address, pgm_read_byte(table + i), 1, table + i + 1, 1, NULL, 0, flags);
+    if (returnStatus)
+    {
+      return (returnStatus);
+    }
+    flags = TRANSFER_FLASH | TRANSFER_REPEATED;
+  }
+  return (0);
+}
+
+//Same as writeTable() for {register, length, bytes...} records, a record
+//running past the end of the table is cut short
+uint8_t I2C::writeRecords(uint8_t address, const uint8_t *table, uint16_t tableSize)
+{
+  uint8_t flags = TRANSFER_FLASH;
+  uint16_t i = 0;
+  while (i + 1 < tableSize)
+  {
+    uint8_t registerAddress = pgm_read_byte(table + i);
+    uint16_t numberBytes = pgm_read_byte(table + i + 1);
+    const uint8_t *record = table + i + 2;
+    i += 2;
+    if (numberBytes > tableSize - i)
     {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
+      numberBytes = tableSize - i;
+    }
+    i += numberBytes;
+    if (i + 1 >= tableSize)
+    {
+      flags |= TRANSFER_STOP;
+    }
+    returnStatus = _transfer(address, registerAddress, 1, record, numberBytes, NULL, 0, flags);
+    if (returnStatus)
+    {
+      return (returnStatus);
+    }
+    flags = TRANSFER_FLASH | TRANSFER_REPEATED;
+  }
+  return (0);
+}
+
+////////// Batch Methods ///////////
+
+//Runs the entries of list in order. Entries are joined with a repeated start
+//unless I2C_STOP is set in direction, a stop is sent after the last one.
+//A NACK only fails its own entry, the batch then carries on with a fresh
+//start. Any other error (timeout, lost arbitration) abandons the batch.
+//Each entry gets its own result in status, the return value is the first
+//error seen (or 0).
+uint8_t I2C::execute(I2CTransaction *list, uint8_t count)
+{
+  uint8_t result = 0;
+  uint8_t flags = 0;
+  for (uint8_t e = 0; e < count; e++)
+  {
+    I2CTransaction *t = &list[e];
+    if ((t->direction & I2C_STOP) || (e == count - 1))
+    {
+      flags |= TRANSFER_STOP;
+    }
+    if (t->direction & I2C_READ)
+    {
+      returnStatus = _transfer(t->address, t->registerAddress, 1, NULL, 0, t->dataBuffer, t->numberBytes ? t->numberBytes : 1, flags);
+    }
+    else
+    {
+      returnStatus = _transfer(t->address, t->registerAddress, 1, t->dataBuffer, t->numberBytes, NULL, 0, flags);
+    }
+    t->status = returnStatus;
+    if (returnStatus)
+    {
+      if ((returnStatus != MT_SLA_NACK) && (returnStatus != MR_SLA_NACK) && (returnStatus != MT_DATA_NACK))
       {
-        return (6);
+        return (returnStatus);
       }
-      if (returnStatus != MR_DATA_NACK)
+      if (!result)
       {
-        return (returnStatus);
+        result = returnStatus;
       }
+      //the stop has already been sent by _sendAddress()/_sendByte()
+      flags = 0;
+      continue;
+    }
+    flags = (flags & TRANSFER_STOP) ? 0 : TRANSFER_REPEATED;
+  }
+  return (result);
+}
+
+#if I2C_ASYNC || I2C_POLLED
+/////////////// Asynchronous Methods ////////////////////////////////////
+//These return 0 once the transfer has been started (or I2C_BUSY if one is
+//already in progress) and never wait on TWINT. The interrupt driven ones
+//hand the result to the callback from interrupt context and to poll(), the
+//polled ones are moved on by service() from the main loop.
+
+//Fills in the single entry batch behind readAsync(), beginRead() and friends
+uint8_t I2C::_asyncSingle(uint8_t address, uint8_t registerAddress, uint8_t direction, uint8_t numberBytes, uint8_t *dataBuffer, I2CCallback callback, uint8_t control)
+{
+  //a sampler read started from TIMER2_COMPA_vect shares asyncSingle, so it
+  //is claimed with interrupts off until the start is on its way
+  uint8_t sreg = SREG;
+  cli();
+  if (asyncStatus == I2C_BUSY)
+  {
+    SREG = sreg;
+    return (I2C_BUSY);
+  }
+  asyncSingle.address = address;
+  asyncSingle.registerAddress = registerAddress;
+  asyncSingle.direction = direction;
+  asyncSingle.numberBytes = numberBytes;
+  asyncSingle.dataBuffer = dataBuffer;
+  uint8_t status = _asyncBegin(&asyncSingle, 1, callback, control);
+  SREG = sreg;
+  return (status);
+}
+
+//Same rules as execute(), list must stay valid until the batch completes.
+//control is or'ed into every TWCR write of the batch, TWIE to have it driven
+//from TWI_vect or 0 to have it driven by service()
+uint8_t I2C::_asyncBegin(I2CTransaction *list, uint8_t count, I2CCallback callback, uint8_t control)
+{
+  //the check, the setup and the start go out as one step, with interrupts
+  //off, so a sampler tick can't claim the engine in between
+  uint8_t sreg = SREG;
+  cli();
+  if (asyncStatus == I2C_BUSY)
+  {
+    SREG = sreg;
+    return (I2C_BUSY);
+  }
+  if (!count)
+  {
+    SREG = sreg;
+    return (0);
+  }
+#if I2C_WRITE_CACHE
+  for (uint8_t e = 0; e < count; e++)
+  {
+    if (!(list[e].direction & I2C_READ) && list[e].numberBytes)
+    {
+      _cacheForget(list[e].address, list[e].registerAddress, list[e].numberBytes);
+    }
+  }
+#endif
+  asyncStatus = I2C_BUSY;
+  asyncList = list;
+  asyncCount = count;
+  asyncEntry = 0;
+#if I2C_ASYNC
+  twiOwner[bus] = this;
+#endif
+  asyncIndex = 0;
+  asyncResult = 0;
+  asyncState = (list[0].direction & I2C_READ) ? ASYNC_READ_START : ASYNC_REGISTER;
+  asyncCallback = callback;
+  asyncControl = control;
+  //a previous stop may still be on the bus
+  while (TWI(TWCR) & (1 << TWSTO))
+    ;
+  TWI(TWCR) = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | asyncControl | ASYNC_LISTEN;
+  SREG = sreg;
+  return (0);
+}
+#endif
+
+#if I2C_ASYNC
+uint8_t I2C::readAsync(uint8_t address, uint8_t registerAddress, uint8_t numberBytes, uint8_t *dataBuffer, I2CCallback callback)
+{
+  return (_asyncSingle(address, registerAddress, I2C_READ, numberBytes, dataBuffer, callback, 1 << TWIE));
+}
+
+uint8_t I2C::writeAsync(uint8_t address, uint8_t registerAddress, const uint8_t *data, uint8_t numberBytes, I2CCallback callback)
+{
+  return (_asyncSingle(address, registerAddress, I2C_WRITE, numberBytes, (uint8_t *)data, callback, 1 << TWIE));
+}
+
+uint8_t I2C::submit(I2CTransaction *list, uint8_t count, I2CCallback callback)
+{
+  return (_asyncBegin(list, count, callback, 1 << TWIE));
+}
+
+uint8_t I2C::poll()
+{
+  return (asyncStatus);
+}
+#endif
+
+#if I2C_POLLED
+uint8_t I2C::beginRead(uint8_t address, uint8_t registerAddress, uint8_t numberBytes, uint8_t *dataBuffer)
+{
+  return (_asyncSingle(address, registerAddress, I2C_READ, numberBytes, dataBuffer, NULL, 0));
+}
+
+uint8_t I2C::beginWrite(uint8_t address, uint8_t registerAddress, const uint8_t *data, uint8_t numberBytes)
+{
+  return (_asyncSingle(address, registerAddress, I2C_WRITE, numberBytes, (uint8_t *)data, NULL, 0));
+}
+
+uint8_t I2C::beginBatch(I2CTransaction *list, uint8_t count)
+{
+  return (_asyncBegin(list, count, NULL, 0));
+}
+
+//Moves a begin*() transfer on by at most one TWI step and never waits
+uint8_t I2C::service()
+{
+  if ((asyncStatus == I2C_BUSY) && !asyncControl && (TWI(TWCR) & (1 << TWINT)))
+  {
+    _asyncStep();
+  }
+  return (asyncStatus);
+}
+#endif
+
+#if I2C_ASYNC || I2C_POLLED
+void I2C::_asyncStep()
+{
+  I2CTransaction *t = &asyncList[asyncEntry];
+  switch (TWI_STATUS)
+  {
+  case START:
+  case REPEATED_START:
+    if (asyncState == ASYNC_READ)
+    {
+      TWI(TWDR) = SLA_R(t->address);
+    }
+    else
+    {
+      TWI(TWDR) = SLA_W(t->address);
+    }
+    TWI(TWCR) = (1 << TWINT) | (1 << TWEN) | asyncControl;
+    break;
+  case MT_SLA_ACK:
+    TWI(TWDR) = t->registerAddress;
+    TWI(TWCR) = (1 << TWINT) | (1 << TWEN) | asyncControl;
+    break;
+  case MT_DATA_ACK:
+    if (asyncState == ASYNC_READ_START)
+    {
+      //register pointer is set, turn the bus around with a repeated start
+      asyncState = ASYNC_READ;
+      TWI(TWCR) = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | asyncControl | ASYNC_LISTEN;
+      break;
+    }
+    asyncState = ASYNC_WRITE;
+    if (asyncIndex < t->numberBytes)
+    {
+      TWI(TWDR) = t->dataBuffer[asyncIndex++];
+      TWI(TWCR) = (1 << TWINT) | (1 << TWEN) | asyncControl;
+      break;
+    }
+    _asyncNext(0);
+    break;
+  case MR_DATA_ACK:
+    t->dataBuffer[asyncIndex++] = TWI(TWDR);
+    //fall through
+  case MR_SLA_ACK:
+    //NACK the last byte so the slave releases the bus
+    if (asyncIndex + 1 < t->numberBytes)
+    {
+      TWI(TWCR) = (1 << TWINT) | (1 << TWEN) | asyncControl | (1 << TWEA);
+    }
+    else
+    {
+      TWI(TWCR) = (1 << TWINT) | (1 << TWEN) | asyncControl;
+    }
+    break;
+  case MR_DATA_NACK:
+    t->dataBuffer[asyncIndex++] = TWI(TWDR);
+    _asyncNext(0);
+    break;
+  case MT_SLA_NACK:
+  case MR_SLA_NACK:
+  case MT_DATA_NACK:
+    _asyncNext(TWI_STATUS);
+    break;
+  default:
+  {
+    //arbitration lost or bus error, the rest of the batch is abandoned
+    uint8_t bufferedStatus = TWI_STATUS;
+    lockUp(0);
+    t->status = bufferedStatus;
+    _asyncFinish(bufferedStatus);
+    break;
+  }
+  }
+}
+
+//Closes the current entry and moves the bus on to the next one
+void I2C::_asyncNext(uint8_t status)
+{
+  I2CTransaction *t = &asyncList[asyncEntry];
+  t->status = status;
+  if (status && !asyncResult)
+  {
+    asyncResult = status;
+  }
+  if (++asyncEntry >= asyncCount)
+  {
+    TWI(TWCR) = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO) | SLAVE_LISTEN;
+    _asyncFinish(asyncResult);
+    return;
+  }
+  uint8_t stop = status || (t->direction & I2C_STOP);
+  t++;
+  asyncIndex = 0;
+  asyncState = (t->direction & I2C_READ) ? ASYNC_READ_START : ASYNC_REGISTER;
+  if (stop)
+  {
+    //TWSTO and TWSTA together send a stop followed by a start
+    TWI(TWCR) = (1 << TWINT) | (1 << TWSTA) | (1 << TWSTO) | (1 << TWEN) | asyncControl | ASYNC_LISTEN;
+  }
+  else
+  {
+    TWI(TWCR) = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | asyncControl | ASYNC_LISTEN;
+  }
+}
+
+void I2C::_asyncFinish(uint8_t status)
+{
+  asyncStatus = status;
+  if (asyncCallback)
+  {
+    asyncCallback(status);
+  }
+}
+#endif
+
+#if I2C_SLAVE
+/////////////// Slave Methods ////////////////////////////////////////
+//The master sees registers[] as a register map: the first byte it writes
+//sets the register pointer, every further byte is stored there and the
+//pointer moves on, reads start at the pointer and move it on the same way.
+//Registers past size read as 0xFF and ignore writes.
+
+void I2C::beginSlave(uint8_t address, uint8_t *registers, uint8_t size, const uint8_t *protect, I2CSlaveCallback callback)
+{
+  slaveMap = registers;
+  slaveProtect = protect;
+  slaveSize = size;
+  slavePointer = 0;
+  slaveCount = 0;
+  slaveCallback = callback;
+  twiOwner[bus] = this;
+  slaveOwner[bus] = this;
+  TWI(TWAR) = address << 1;
+  TWI(TWCR) = (1 << TWINT) | (1 << TWEN) | (1 << TWEA) | (1 << TWIE);
+}
+
+void I2C::endSlave()
+{
+  if (slaveOwner[bus] == this)
+  {
+    slaveOwner[bus] = NULL;
+  }
+  TWI(TWAR) = 0;
+  TWI(TWCR) = _BV(TWEN) | _BV(TWEA);
+}
+
+void I2C::_slaveStep()
+{
+  switch (TWI_STATUS)
+  {
+  case SR_SLA_ACK:
+  case SR_ARB_LOST_SLA_ACK:
+    slaveState = SLAVE_POINTER;
+    break;
+  case SR_DATA_ACK:
+  case SR_DATA_NACK:
+    if (slaveState == SLAVE_POINTER)
+    {
+      slavePointer = TWI(TWDR);
+      slaveFirst = slavePointer;
+      slaveState = SLAVE_DATA;
+      break;
+    }
+    if ((slavePointer < slaveSize) && !(slaveProtect && (slaveProtect[slavePointer >> 3] & _BV(slavePointer & 7))))
+    {
+      slaveMap[slavePointer] = TWI(TWDR);
+      slaveCount++;
+    }
+    slavePointer++;
+    break;
+  case SR_STOP:
+    if (slaveCount && slaveCallback)
+    {
+      slaveCallback(slaveFirst, slaveCount);
+    }
+    slaveCount = 0;
+    break;
+  case ST_SLA_ACK:
+  case ST_ARB_LOST_SLA_ACK:
+  case ST_DATA_ACK:
+    TWI(TWDR) = (slavePointer < slaveSize) ? slaveMap[slavePointer] : 0xFF;
+    slavePointer++;
+    break;
+  case ST_DATA_NACK:
+  case ST_LAST_DATA:
+    break;
+  default:
+    //bus error, release the lines and go back to listening
+    TWI(TWCR) = (1 << TWINT) | (1 << TWSTO) | (1 << TWEN) | (1 << TWEA) | (1 << TWIE);
+    return;
+  }
+  TWI(TWCR) = (1 << TWINT) | (1 << TWEN) | (1 << TWEA) | (1 << TWIE);
+}
+#endif
+
+#if I2C_ASYNC || I2C_SLAVE || I2C_SLEEP
+void I2C::_twiInterrupt()
+{
+#if I2C_SLEEP
+  if (sleepWaiting)
+  {
+    //TWINT is written back as 0 so the next step isn't started from here,
+    //_twiStep() reads the status itself
+    TWI(TWCR) = TWI(TWCR) & ~((1 << TWIE) | (1 << TWINT));
+    return;
+  }
+#endif
+#if I2C_SLAVE
+#if I2C_ASYNC
+  uint8_t status = TWI_STATUS;
+  //the slave states all come after the master ones
+  if ((status < SR_SLA_ACK) && (asyncStatus == I2C_BUSY))
+  {
+    _asyncStep();
+    return;
+  }
+  uint8_t lost = (asyncStatus == I2C_BUSY) && ((status == SR_ARB_LOST_SLA_ACK) || (status == ST_ARB_LOST_SLA_ACK));
+  if (lost)
+  {
+    //the master that won the bus addressed our slave, the transfer is over
+    //before the slave answers. The callback only runs after it, so a next
+    //transfer it starts just queues its start for when the bus is free.
+    asyncList[asyncEntry].status = LOST_ARBTRTN;
+    asyncStatus = LOST_ARBTRTN;
+  }
+#endif
+  if (slaveOwner[bus])
+  {
+    slaveOwner[bus]->_slaveStep();
+  }
+  else
+  {
+    //nothing to answer with, let go of the bus
+    TWI(TWCR) = (1 << TWINT) | (1 << TWEN);
+  }
+#if I2C_ASYNC
+  if (lost && asyncCallback)
+  {
+    asyncCallback(LOST_ARBTRTN);
+  }
+#endif
+#elif I2C_ASYNC
+  _asyncStep();
+#endif
+}
+
+ISR(TWI_vect)
+{
+  twiOwner[0]->_twiInterrupt();
+}
+
+#if I2C_TWI_BUSES > 1
+ISR(TWI1_vect)
+{
+  twiOwner[1]->_twiInterrupt();
+}
+#endif
+#endif
+
+#if I2C_SAMPLER
+//Timer2 prescalers selected by CS22:0 = 1 to 7
+static const uint16_t samplerPrescalers[] = {1, 8, 32, 64, 128, 256, 1024};
+
+//Instance Timer2 ticks, the last one to call beginSampler()
+static I2C *samplerOwner = &I2c;
+
+//Runs Timer2 in CTC mode with the smallest prescaler that fits the tick in
+//OCR2A, the tick is clamped to what the timer can count (16ms at 16MHz)
+uint16_t I2C::beginSampler(I2CSampleJob *jobs, uint8_t count, uint16_t tickMicros)
+{
+  endSampler();
+  for (uint8_t i = 0; i < count; i++)
+  {
+    jobs[i].head = 0;
+    jobs[i].tail = 0;
+    jobs[i].overruns = 0;
+    jobs[i].status = 0;
+    jobs[i].due = 0;
+    jobs[i].countdown = jobs[i].period ? jobs[i].period : 1;
+  }
+  samplerJobs = jobs;
+  samplerActive = SAMPLER_IDLE;
+  samplerOwner = this;
+  //in kHz so clocks under 1MHz still count
+  uint32_t cycles = (F_CPU / 1000) * (uint32_t)tickMicros / 1000;
+  uint8_t select = 0;
+  while ((select < 6) && (cycles / samplerPrescalers[select] > 256))
+  {
+    select++;
+  }
+  uint32_t top = cycles / samplerPrescalers[select];
+  if (top > 256)
+  {
+    top = 256;
+  }
+  if (!top)
+  {
+    top = 1;
+  }
+  TCCR2B = 0;
+  TCCR2A = _BV(WGM21);
+  TCNT2 = 0;
+  OCR2A = top - 1;
+  samplerCount = count;
+  TCCR2B = select + 1;
+  TIMSK2 |= _BV(OCIE2A);
+  return (top * samplerPrescalers[select] * 1000 / (F_CPU / 1000));
+}
+
+//A read still in progress is left to finish, its sample is dropped
+void I2C::endSampler()
+{
+  TIMSK2 &= ~_BV(OCIE2A);
+  TCCR2B = 0;
+  samplerCount = 0;
+}
+
+//Copies the oldest sample of job into dest and its timestamp into stamp,
+//returns 0 if there was none
+uint8_t I2C::takeSample(I2CSampleJob *job, uint8_t *dest, uint32_t *stamp)
+{
+  uint8_t tail = job->tail;
+  if (tail == job->head)
+  {
+    return (0);
+  }
+  memcpy(dest, job->ring + tail * job->numberBytes, job->numberBytes);
+  if (stamp)
+  {
+    *stamp = job->stamps ? job->stamps[tail] : 0;
+  }
+  job->tail = (tail + 1 < job->depth) ? tail + 1 : 0;
+  return (1);
+}
+
+//Marks the jobs whose period is up, a job still waiting from its last
+//period counts as an overrun. The reads start right away if the bus is free.
+void I2C::_samplerTick()
+{
+  uint32_t now = micros();
+  for (uint8_t i = 0; i < samplerCount; i++)
+  {
+    I2CSampleJob *job = &samplerJobs[i];
+    if (--job->countdown)
+    {
+      continue;
+    }
+    job->countdown = job->period ? job->period : 1;
+    if (job->due)
+    {
+      job->overruns++;
+      continue;
+    }
+    job->due = 1;
+    job->dueStamp = now;
+  }
+  if ((samplerActive == SAMPLER_IDLE) && (asyncStatus != I2C_BUSY))
+  {
+    _samplerNext();
+  }
+}
+
+//Starts the first due job that has room in its ring. A transfer of the
+//sketch keeps them waiting until the next tick.
+void I2C::_samplerNext()
+{
+  for (uint8_t i = 0; i < samplerCount; i++)
+  {
+    I2CSampleJob *job = &samplerJobs[i];
+    if (!job->due)
+    {
+      continue;
+    }
+    uint8_t next = (job->head + 1 < job->depth) ? job->head + 1 : 0;
+    if (next == job->tail)
+    {
+      job->due = 0;
+      job->overruns++;
+      continue;
+    }
+    samplerActive = i;
+    job->due = 0;
+    if (_asyncSingle(job->address, job->registerAddress, I2C_READ, job->numberBytes, job->ring + job->head * job->numberBytes, _samplerDone, 1 << TWIE))
+    {
+      samplerActive = SAMPLER_IDLE;
+      job->due = 1;
+    }
+    return;
+  }
+}
+
+//Completion callback of the sampler reads, runs from TWI_vect
+void I2C::_samplerDone(uint8_t status)
+{
+  I2C *owner = samplerOwner;
+  uint8_t active = owner->samplerActive;
+  owner->samplerActive = SAMPLER_IDLE;
+  if (active >= owner->samplerCount)
+  {
+    return;
+  }
+  I2CSampleJob *job = &owner->samplerJobs[active];
+  job->status = status;
+  if (status)
+  {
+    job->overruns++;
+  }
+  else
+  {
+    if (job->stamps)
+    {
+      job->stamps[job->head] = job->dueStamp;
+    }
+    job->head = (job->head + 1 < job->depth) ? job->head + 1 : 0;
+  }
+  owner->_samplerNext();
+}
+
+ISR(TIMER2_COMPA_vect)
+{
+  samplerOwner->_samplerTick();
+}
+#endif
+
+#if I2C_BACKEND == I2C_BACKEND_TWI
+//////////// LOW-LEVEL METHODS (No need to use them if the device uses normal register protocal)
+uint8_t I2C::_start()
+{
+  PHASE(I2C_PHASE_START);
+  if (_twiStep((1 << TWINT) | (1 << TWSTA) | (1 << TWEN)))
+  {
+    return (1);
+  }
+  PHASE(I2C_PHASE_START | I2C_PHASE_END);
+  if ((TWI_STATUS == START) || (TWI_STATUS == REPEATED_START))
+  {
+    return (0);
+  }
+  if (TWI_STATUS == LOST_ARBTRTN)
+  {
+    uint8_t bufferedStatus = TWI_STATUS;
+    lockUp(0);
+    return (bufferedStatus);
+  }
+  return (TWI_STATUS);
+}
+
+uint8_t I2C::_sendAddress(uint8_t i2cAddress)
+{
+  PHASE(I2C_PHASE_ADDRESS);
+  TWI(TWDR) = i2cAddress;
+  if (_twiStep((1 << TWINT) | (1 << TWEN)))
+  {
+    return (1);
+  }
+  PHASE(I2C_PHASE_ADDRESS | I2C_PHASE_END);
+  if ((TWI_STATUS == MT_SLA_ACK) || (TWI_STATUS == MR_SLA_ACK))
+  {
+    return (0);
+  }
+  uint8_t bufferedStatus = TWI_STATUS;
+  if ((TWI_STATUS == MT_SLA_NACK) || (TWI_STATUS == MR_SLA_NACK))
+  {
+    _stop();
+    return (bufferedStatus);
+  }
+  else
+  {
+    lockUp(0);
+    return (bufferedStatus);
+  }
+}
+
+uint8_t I2C::_sendByte(uint8_t i2cData)
+{
+  PHASE(I2C_PHASE_SEND);
+  TWI(TWDR) = i2cData;
+  if (_twiStep((1 << TWINT) | (1 << TWEN)))
+  {
+    return (1);
+  }
+  PHASE(I2C_PHASE_SEND | I2C_PHASE_END);
+  if (TWI_STATUS == MT_DATA_ACK)
+  {
+    return (0);
+  }
+  uint8_t bufferedStatus = TWI_STATUS;
+  if (TWI_STATUS == MT_DATA_NACK)
+  {
+    _stop();
+    return (bufferedStatus);
+  }
+  else
+  {
+    lockUp(0);
+    return (bufferedStatus);
+  }
+}
+
+uint8_t I2C::_receiveByte(uint8_t ack)
+{
+  PHASE(I2C_PHASE_RECEIVE);
+  if (_twiStep(ack ? (1 << TWINT) | (1 << TWEN) | (1 << TWEA) : (1 << TWINT) | (1 << TWEN)))
+  {
+    return (1);
+  }
+  PHASE(I2C_PHASE_RECEIVE | I2C_PHASE_END);
+  if (TWI_STATUS == LOST_ARBTRTN)
+  {
+    uint8_t bufferedStatus = TWI_STATUS;
+    lockUp(0);
+    return (bufferedStatus);
+  }
+  return (TWI_STATUS);
+}
+
+uint8_t I2C::_receiveByte(uint8_t ack, uint8_t *target)
+{
+  uint8_t stat = I2C::_receiveByte(ack);
+  if (stat == 1)
+  {
+    return (6);
+  }
+  if (ack)
+  {
+    if (stat != MR_DATA_ACK)
+    {
+      *target = 0x0;
+      return (stat);
+    }
+  }
+  else
+  {
+    if (stat != MR_DATA_NACK)
+    {
+      *target = 0x0;
+      return (stat);
     }
-    else
+  }
+  *target = TWI(TWDR);
+  // I suppose that if we get this far we're ok
+  return 0;
+}
+
+uint8_t I2C::_stop()
+{
+  PHASE(I2C_PHASE_STOP);
+  uint32_t spins = timeOutSpins;
+  TWI(TWCR) = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO) | SLAVE_LISTEN;
+  while ((TWI(TWCR) & (1 << TWSTO)))
+  {
+    if (spins && !--spins)
     {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_ACK)
+      lockUp(1);
+      return (1);
+    }
+  }
+  PHASE(I2C_PHASE_STOP | I2C_PHASE_END);
+  return (0);
+}
+
+//Writes control to TWCR and waits for TWINT, returns 1 after lockUp() on a
+//timeout. The stop has no interrupt of its own and is always spun on.
+uint8_t I2C::_twiStep(uint8_t control)
+{
+#if I2C_SLEEP
+  //sleeping with interrupts off (e.g. called from an ISR) would never wake
+  if (SREG & (1 << SREG_I))
+  {
+    //idle wakes on any interrupt, the millis() tick included, so a hung bus
+    //is still timed out, by micros() as the spins don't count here
+    const uint8_t cyclesPerMicro = (F_CPU / 1000000) ? (F_CPU / 1000000) : 1;
+    uint32_t limit = (timeOutSpins / cyclesPerMicro) * SPIN_CYCLES;
+    unsigned long startingTime = micros();
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    cli();
+    //borrowed from a slave or async transfer of another object on the bus
+    //and handed back once the step is done
+    I2C *owner = twiOwner[bus];
+    twiOwner[bus] = this;
+    sleepWaiting = 1;
+    TWI(TWCR) = control | (1 << TWIE);
+    while (!(TWI(TWCR) & (1 << TWINT)))
+    {
+      //sei() only takes effect after the next instruction, so TWI_vect
+      //can't slip in between the check and the sleep
+      sleep_enable();
+      sei();
+      sleep_cpu();
+      sleep_disable();
+      cli();
+      if (limit && ((micros() - startingTime) >= limit))
       {
-        return (returnStatus);
+        sleepWaiting = 0;
+        twiOwner[bus] = owner;
+        TWI(TWCR) = TWI(TWCR) & ~((1 << TWIE) | (1 << TWINT));
+        sei();
+        lockUp(1);
+        return (1);
       }
     }
-    data[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
+    sleepWaiting = 0;
+    twiOwner[bus] = owner;
+    sei();
+    return (0);
   }
-  returnStatus = _stop();
-  if (returnStatus)
+#endif
+  uint32_t spins = timeOutSpins;
+  TWI(TWCR) = control;
+  while (!(TWI(TWCR) & (1 << TWINT)))
   {
-    if (returnStatus == 1)
+    if (spins && !--spins)
     {
-      return (7);
+      lockUp(1);
+      return (1);
     }
-    return (returnStatus);
   }
-  return (returnStatus);
+  return (0);
 }
+#endif
 
-uint8_t I2C::read(uint8_t address, uint8_t numberBytes, uint8_t *dataBuffer)
+/////////////// Private Methods ////////////////////////////////////////
+
+//Reads numberBytes in one transaction, handing every chunkSize bytes (and
+//the remainder at the end) to callback through the same chunk buffer
+uint8_t I2C::_stream(uint8_t address, uint16_t registerAddress, uint8_t registerBytes, uint16_t numberBytes, uint8_t *chunk, uint8_t chunkSize, I2CChunkCallback callback)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  if (numberBytes == 0)
+  if (!numberBytes || !chunkSize)
   {
-    numberBytes++;
+    return (0);
   }
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
+  streamCallback = callback;
+  streamChunk = chunkSize;
+  return (_transfer(address, registerAddress, registerBytes, NULL, 0, chunk, numberBytes, TRANSFER_STOP | TRANSFER_STREAM));
+}
+
+//Reverses each group of width bytes in place, used by readInto()
+void I2C::_swapBytes(uint8_t *buffer, uint16_t numberBytes, uint8_t width)
+{
+  if (width < 2)
   {
-    return (returnStatus);
+    return;
   }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
+  for (uint16_t i = 0; i + width <= numberBytes; i += width)
   {
-    if (returnStatus == 1)
+    for (uint8_t j = 0; j < width / 2; j++)
     {
-      return (5);
+      uint8_t temp = buffer[i + j];
+      buffer[i + j] = buffer[i + width - 1 - j];
+      buffer[i + width - 1 - j] = temp;
     }
-    return (returnStatus);
   }
-  for (uint8_t i = 0; i < numberBytes; i++)
+}
+
+#if I2C_PRESENCE
+//Returns the entry tracking address or I2C_PRESENCE
+uint8_t I2C::_presenceFind(uint8_t address)
+{
+  for (uint8_t i = 0; i < I2C_PRESENCE; i++)
   {
-    if (i == nack)
+    if (presenceNacks[i] && (presenceAddress[i] == address))
     {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_NACK)
-      {
-        return (returnStatus);
-      }
+      return (i);
     }
-    else
+  }
+  return (I2C_PRESENCE);
+}
+
+//Called by _transfer() first. Leaves the NACK in returnStatus and returns 1
+//when the device is absent and not due for a re-probe.
+uint8_t I2C::_presenceSkip(uint8_t address)
+{
+  if (!presenceLimit)
+  {
+    return (0);
+  }
+  uint8_t entry = _presenceFind(address);
+  if ((entry >= I2C_PRESENCE) || (presenceNacks[entry] < presenceLimit))
+  {
+    return (0);
+  }
+  unsigned long now = millis();
+  if ((now - presenceProbe[entry]) < presenceInterval)
+  {
+    returnStatus = presenceStatus[entry];
+    return (1);
+  }
+  presenceProbe[entry] = now;
+  return (0);
+}
+
+//Counts an address NACK, anything showing the address was ACKed forgets
+//the device. Timeouts and lost arbitration say nothing either way. A NACK
+//is not tracked when the table is full.
+void I2C::_presenceUpdate(uint8_t address, uint8_t status)
+{
+  if (!presenceLimit)
+  {
+    return;
+  }
+  uint8_t entry = _presenceFind(address);
+  if ((status != MT_SLA_NACK) && (status != MR_SLA_NACK))
+  {
+    if ((entry < I2C_PRESENCE) && ((status == 0) || (status == MT_DATA_NACK)))
     {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_ACK)
-      {
-        return (returnStatus);
-      }
+      presenceNacks[entry] = 0;
     }
-    dataBuffer[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
+    return;
   }
-  returnStatus = _stop();
-  if (returnStatus)
+  if (entry >= I2C_PRESENCE)
   {
-    if (returnStatus == 1)
+    for (entry = 0; (entry < I2C_PRESENCE) && presenceNacks[entry]; entry++)
+      ;
+    if (entry >= I2C_PRESENCE)
     {
-      return (7);
+      return;
     }
-    return (returnStatus);
+    presenceAddress[entry] = address;
   }
-  return (returnStatus);
+  if (presenceNacks[entry] < presenceLimit)
+  {
+    presenceNacks[entry]++;
+  }
+  presenceStatus[entry] = status;
+  presenceProbe[entry] = millis();
 }
+#endif
 
-uint8_t I2C::readex(uint8_t address, uint16_t numberBytes, uint8_t *dataBuffer)
+#if I2C_SMBUS
+//CRC-8 with polynomial x^8 + x^2 + x + 1, the SMBus PEC
+static const uint8_t pecTable[256] PROGMEM = {
+    0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+    0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65, 0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+    0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5, 0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+    0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85, 0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+    0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2, 0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+    0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2, 0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+    0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32, 0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+    0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42, 0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+    0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C, 0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+    0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC, 0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+    0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C, 0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+    0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C, 0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+    0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B, 0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+    0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B, 0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+    0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB, 0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+    0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB, 0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3};
+
+static inline uint8_t pecUpdate(uint8_t pec, uint8_t value)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  if (numberBytes == 0)
+  return (pgm_read_byte(pecTable + (pec ^ value)));
+}
+
+//The SMBus counterpart of _transferPhases(), written with the low-level
+//methods so every backend shares it. registerAddress is the command. With
+//TRANSFER_BLOCK_WRITE txLen goes out as a count first, with
+//TRANSFER_BLOCK_READ the first byte read is the count, which decides where
+//the NACK goes; bytes past rxLen are still read (and checked) but dropped.
+//The PEC is updated as each byte goes out or comes in, no second pass.
+uint8_t I2C::_smbusPhases(uint8_t address, uint16_t registerAddress, uint8_t registerBytes, const uint8_t *txData, uint16_t txLen, uint8_t *rxData, uint16_t rxLen, uint8_t flags)
+{
+  uint8_t pec = pecUpdate(0, SLA_W(address));
+  returnStatus = _start();
+  if (returnStatus)
   {
-    numberBytes++;
+    return (timeOutStage(returnStatus, (flags & TRANSFER_REPEATED) ? 4 : 1));
   }
-  uint16_t nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
+  returnStatus = _sendAddress(SLA_W(address));
   if (returnStatus)
   {
-    return (returnStatus);
+    return (timeOutStage(returnStatus, 2));
+  }
+  //the command code, sent like the register address of _transferPhases()
+  if (registerBytes == 2)
+  {
+    returnStatus = _smbusSend(registerAddress >> 8, &pec);
+  }
+  if (!returnStatus && registerBytes)
+  {
+    returnStatus = _smbusSend(registerAddress & 0xFF, &pec);
+  }
+  if (!returnStatus && (flags & TRANSFER_BLOCK_WRITE))
+  {
+    returnStatus = _smbusSend(txLen, &pec);
+  }
+  for (uint16_t i = 0; !returnStatus && (i < txLen); i++)
+  {
+    returnStatus = _smbusSend(txData[i], &pec);
+  }
+  uint8_t reading = rxLen || (flags & TRANSFER_BLOCK_READ);
+  if (!returnStatus && (flags & TRANSFER_PEC) && !reading)
+  {
+    returnStatus = _smbusSend(pec, &pec);
   }
-  returnStatus = _sendAddress(SLA_R(address));
   if (returnStatus)
   {
-    if (returnStatus == 1)
-    {
-      return (5);
-    }
-    return (returnStatus);
+    return (timeOutStage(returnStatus, 3));
   }
-  for (uint16_t i = 0; i < numberBytes; i++)
+  uint8_t result = 0;
+  if (reading)
   {
-    if (i == nack)
+    returnStatus = _start();
+    if (returnStatus)
     {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
+      return (timeOutStage(returnStatus, 4));
+    }
+    pec = pecUpdate(pec, SLA_R(address));
+    returnStatus = _sendAddress(SLA_R(address));
+    if (returnStatus)
+    {
+      return (timeOutStage(returnStatus, 5));
+    }
+    uint8_t value;
+    uint16_t count = rxLen;
+    if (flags & TRANSFER_BLOCK_READ)
+    {
+      //a count of 0 without a PEC still needs a byte to NACK
+      returnStatus = _receiveByte(1, &value);
+      if (returnStatus)
       {
-        return (6);
+        return (returnStatus);
       }
-      if (returnStatus != MR_DATA_NACK)
+      pec = pecUpdate(pec, value);
+      count = value;
+      smbusCount = value;
+      if (count > rxLen)
       {
-        return (returnStatus);
+        result = I2C_BLOCK_OVERFLOW;
       }
     }
-    else
+    uint16_t total = count + ((flags & TRANSFER_PEC) ? 1 : 0);
+    uint16_t last = total ? total - 1 : 0;
+    for (uint16_t i = 0; i <= last; i++)
     {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
+      returnStatus = _receiveByte(i != last, &value);
+      if (returnStatus)
       {
-        return (6);
+        return (returnStatus);
       }
-      if (returnStatus != MR_DATA_ACK)
+      if (i < count)
       {
-        return (returnStatus);
+        pec = pecUpdate(pec, value);
+        if (i < rxLen)
+        {
+          rxData[i] = value;
+        }
+      }
+      else if ((flags & TRANSFER_PEC) && (value != pec))
+      {
+        result = I2C_PEC_ERROR;
       }
     }
-    dataBuffer[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
   }
-  returnStatus = _stop();
-  if (returnStatus)
+  if (flags & TRANSFER_STOP)
   {
-    if (returnStatus == 1)
+    returnStatus = _stop();
+    if (returnStatus)
     {
-      return (7);
+      return (timeOutStage(returnStatus, 7));
     }
-    return (returnStatus);
   }
-  return (returnStatus);
+  return (result);
 }
 
-uint8_t I2C::read(uint8_t address, uint8_t registerAddress, uint8_t numberBytes, uint8_t *dataBuffer)
+//Sends one byte of _smbusPhases() and adds it to the PEC
+uint8_t I2C::_smbusSend(uint8_t value, uint8_t *pec)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  if (numberBytes == 0)
+  *pec = pecUpdate(*pec, value);
+  return (_sendByte(value));
+}
+#endif
+
+#if I2C_MUX_DEVICES
+#define MUX_UNKNOWN 0xFF
+
+//Turns a handle from addMuxDevice() into the address of the device behind
+//it, switching the muxes over first unless the channel is already selected.
+//The TCA9548A only connects a channel on the stop, so the switch can't share
+//a repeated start with the transfer, which then starts afresh.
+uint8_t I2C::_muxRoute(uint8_t *address, uint8_t *flags)
+{
+  uint8_t index = *address & 0x7F;
+  if (index >= muxCount)
   {
-    numberBytes++;
+    //nothing answers at a handle that was never handed out
+    return (_failEarly(MT_SLA_NACK, *flags));
   }
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
+  I2CMux *mux = muxOf[index];
+  uint8_t mask = 1 << muxChannel[index];
+  *address = muxAddress[index];
+  if (mux->selected == mask)
   {
-    return (returnStatus);
+    return (0);
   }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
+  for (uint8_t i = 0; i < muxCount; i++)
   {
-    if (returnStatus == 1)
+    if ((muxOf[i] != mux) && muxOf[i]->selected)
     {
-      return (2);
+      returnStatus = _muxSelect(muxOf[i], 0, *flags);
+      if (returnStatus)
+      {
+        return (returnStatus);
+      }
+      *flags &= ~TRANSFER_REPEATED;
     }
-    return (returnStatus);
   }
-  returnStatus = _sendByte(registerAddress);
-  if (returnStatus)
+  returnStatus = _muxSelect(mux, mask, *flags);
+  *flags &= ~TRANSFER_REPEATED;
+  return (returnStatus);
+}
+
+//Writes the channel mask to the control register of mux. If that fails the
+//register is unknown, a channel may still be open, so selected is left at
+//MUX_UNKNOWN which matches no mask and is closed like an open channel
+uint8_t I2C::_muxSelect(I2CMux *mux, uint8_t mask, uint8_t flags)
+{
+  returnStatus = _transferPhases(mux->address, mask, 1, NULL, 0, NULL, 0, (flags & TRANSFER_REPEATED) | TRANSFER_STOP);
+  mux->selected = returnStatus ? MUX_UNKNOWN : mask;
+  return (returnStatus);
+}
+#endif
+
+//Addresses the slave until it ACKs, an EEPROM NACKs during its write cycle
+//Longest an EEPROM write cycle is waited for, datasheets give 5 - 10ms
+#define ACK_POLL_LIMIT 20
+
+uint8_t I2C::_ackPoll(uint8_t address)
+{
+#if I2C_MUX_DEVICES
+  if (address & 0x80)
   {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
+    //the write before has left the channel selected
+    address = muxAddress[address & 0x7F];
   }
-  returnStatus = _start();
-  if (returnStatus)
+#endif
+  unsigned long startingTime = millis();
+  do
   {
-    if (returnStatus == 1)
+    returnStatus = _start();
+    if (returnStatus)
     {
-      return (4);
+      return (timeOutStage(returnStatus, 1));
     }
-    return (returnStatus);
+    returnStatus = _sendAddress(SLA_W(address));
+    if (!returnStatus)
+    {
+      returnStatus = _stop();
+      return (timeOutStage(returnStatus, 7));
+    }
+    if (returnStatus != MT_SLA_NACK)
+    {
+      //_sendAddress() has already reset the bus
+      return (timeOutStage(returnStatus, 2));
+    }
+  } while ((millis() - startingTime) < ACK_POLL_LIMIT);
+  return (returnStatus);
+}
+
+#if I2C_BACKEND == I2C_BACKEND_TWI
+void I2C::_setClock(uint8_t bitRate, uint8_t prescaler)
+{
+  if (prescaler & 0x01)
+  {
+    sbi(TWI(TWSR), TWPS0);
   }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
+  else
   {
-    if (returnStatus == 1)
+    cbi(TWI(TWSR), TWPS0);
+  }
+  if (prescaler & 0x02)
+  {
+    sbi(TWI(TWSR), TWPS1);
+  }
+  else
+  {
+    cbi(TWI(TWSR), TWPS1);
+  }
+  TWI(TWBR) = bitRate;
+  _updateTimeOut();
+}
+#endif
+
+//Converts timeOutDelay into the spin budget of the wait loops. The budget
+//never drops below one byte time at the current bit rate so very short
+//deadlines can't fire while a byte is still being shifted out.
+void I2C::_updateTimeOut()
+{
+  if (!timeOutDelay)
+  {
+    timeOutSpins = 0;
+    return;
+  }
+  const uint8_t cyclesPerMicro = (F_CPU / 1000000) ? (F_CPU / 1000000) : 1;
+  uint32_t spins = (timeOutDelay / SPIN_CYCLES) * cyclesPerMicro + ((timeOutDelay % SPIN_CYCLES) * cyclesPerMicro) / SPIN_CYCLES;
+#if I2C_BACKEND == I2C_BACKEND_TWI
+  uint32_t byteCycles = 9 * (16 + ((uint32_t)TWI(TWBR) << (1 + 2 * (TWI(TWSR) & 0x03))));
+#else
+  uint32_t byteCycles = 9 * (F_CPU / clockRate);
+#endif
+  uint32_t minSpins = byteCycles / SPIN_CYCLES + 1;
+  timeOutSpins = (spins > minSpins) ? spins : minSpins;
+}
+
+//Every read and write ends up here. Sends a start (or a repeated start if
+//TRANSFER_REPEATED is set), then unless it is a plain read, SLA+W followed
+//by registerBytes of registerAddress (MSB first) and txLen bytes of txData.
+//If rxLen is set it turns the bus around with a repeated start and reads
+//rxLen bytes into rxData (dropped if NULL), NACKing the last one. A stop is only sent when
+//TRANSFER_STOP is set. Timeouts are reported as the stage they happened in
+//(see the list above write()), anything else as the TWI status.
+uint8_t I2C::_transfer(uint8_t address, uint16_t registerAddress, uint8_t registerBytes, const uint8_t *txData, uint16_t txLen, uint8_t *rxData, uint16_t rxLen, uint8_t flags)
+{
+#if I2C_PRESENCE
+  if (_presenceSkip(address))
+  {
+    return (_failEarly(returnStatus, flags));
+  }
+  uint8_t caller = address; //the mux routing below replaces a handle
+#endif
+#if I2C_WRITE_CACHE
+  if (txLen)
+  {
+    //a 16-bit register map doesn't line up with the cache, drop the device
+    _cacheForget(address, (registerBytes == 1) ? registerAddress : 0, (registerBytes == 1) ? txLen : 0x100);
+  }
+#endif
+#if I2C_MUX_DEVICES
+  if (address & 0x80)
+  {
+    returnStatus = _muxRoute(&address, &flags);
+    if (returnStatus)
     {
-      return (5);
+      return (returnStatus);
     }
-    return (returnStatus);
   }
-  for (uint8_t i = 0; i < numberBytes; i++)
+#endif
+  for (uint8_t attempt = 1;; attempt++)
   {
-    if (i == nack)
+#if I2C_STATS
+    unsigned long startingTime = micros();
+#endif
+#if I2C_SMBUS
+    if (flags & TRANSFER_SMBUS)
     {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_NACK)
-      {
-        return (returnStatus);
-      }
+      returnStatus = _smbusPhases(address, registerAddress, registerBytes, txData, txLen, rxData, rxLen, flags);
     }
     else
+#endif
     {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_ACK)
-      {
-        return (returnStatus);
-      }
+      returnStatus = _transferPhases(address, registerAddress, registerBytes, txData, txLen, rxData, rxLen, flags);
     }
-    dataBuffer[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
+#if I2C_STATS
+    _countTransfer(returnStatus, registerBytes + txLen + rxLen, micros() - startingTime);
+#endif
+#if I2C_TRACE
+    _traceTransfer(address | (rxLen ? 0x80 : 0), registerAddress, txLen + rxLen, returnStatus);
+#endif
+    //chunks already handed to the callback can't be taken back
+    if ((attempt >= retryAttempts) || (flags & TRANSFER_STREAM) || !_retryable(returnStatus))
     {
-      return (7);
+#if I2C_PRESENCE
+      _presenceUpdate(caller, returnStatus);
+#endif
+      return (returnStatus);
     }
-    return (returnStatus);
+#if I2C_STATS
+    statistics.retries++;
+#endif
+    _backoff(attempt);
+    //the bus was released, the next attempt starts afresh
+    flags &= ~TRANSFER_REPEATED;
   }
-  return (returnStatus);
 }
 
-uint8_t I2C::readex(uint8_t address, uint8_t registerAddress, uint16_t numberBytes, uint8_t *dataBuffer)
+//Lost arbitration means another master took the bus, an address NACK that
+//the slave is busy (an EEPROM in its write cycle), both are worth retrying
+uint8_t I2C::_retryable(uint8_t status)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  if (numberBytes == 0)
+  if (status == LOST_ARBTRTN)
   {
-    numberBytes++;
+    return (1);
   }
-  uint16_t nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
+#if I2C_SMBUS
+  //a corrupted read is as worth repeating as a lost arbitration
+  if (status == I2C_PEC_ERROR)
   {
-    return (returnStatus);
+    return (1);
   }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
+#endif
+  return (retryNack && ((status == MT_SLA_NACK) || (status == MR_SLA_NACK)));
+}
+
+//Waits a random time of up to retryBackoff microseconds, doubling with each
+//attempt up to 8 times as long, so contending masters don't retry in step
+void I2C::_backoff(uint8_t attempt)
+{
+  static uint16_t seed = 1;
+  if (!retryBackoff)
   {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
+    return;
   }
-  returnStatus = _sendByte(registerAddress);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
+  //xorshift, stirred with a free running timer so boards running the same
+  //code drift apart
+#if I2C_BACKEND == I2C_BACKEND_TWI
+  seed ^= TCNT0;
+#else
+  seed ^= micros();
+#endif
+  seed ^= seed << 7;
+  seed ^= seed >> 9;
+  seed ^= seed << 8;
+  uint32_t window = (uint32_t)retryBackoff << ((attempt > 4) ? 3 : attempt - 1);
+  uint32_t wait = seed % window + 1;
+  while (wait > 16383)
+  {
+    //delayMicroseconds() is only accurate up to 16383us
+    delayMicroseconds(16383);
+    wait -= 16383;
+  }
+  delayMicroseconds(wait);
+}
+
+#if I2C_PRESENCE || I2C_MUX_DEVICES
+//Fails a call that never reached the bus with status. execute() takes an
+//address NACK to mean the stop has been sent, so if an earlier entry left
+//the bus open for a repeated start, this call sends the stop.
+uint8_t I2C::_failEarly(uint8_t status, uint8_t flags)
+{
+  if (flags & TRANSFER_REPEATED)
+  {
+    _stop();
   }
+  return (status);
+}
+#endif
+
+#if I2C_BACKEND != I2C_BACKEND_SAMD
+uint8_t I2C::_transferPhases(uint8_t address, uint16_t registerAddress, uint8_t registerBytes, const uint8_t *txData, uint16_t txLen, uint8_t *rxData, uint16_t rxLen, uint8_t flags)
+{
   returnStatus = _start();
   if (returnStatus)
   {
-    if (returnStatus == 1)
-    {
-      return (4);
-    }
-    return (returnStatus);
+    return (timeOutStage(returnStatus, (flags & TRANSFER_REPEATED) ? 4 : 1));
   }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
+  if (registerBytes || txLen || !rxLen)
   {
-    if (returnStatus == 1)
+    returnStatus = _sendAddress(SLA_W(address));
+    if (returnStatus)
     {
-      return (5);
+      return (timeOutStage(returnStatus, 2));
     }
-    return (returnStatus);
-  }
-  for (uint16_t i = 0; i < numberBytes; i++)
-  {
-    if (i == nack)
+    if (registerBytes == 2)
     {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
+      //Send MSB of register address
+      returnStatus = _sendByte(registerAddress >> 8);
+      if (returnStatus)
       {
-        return (6);
+        return (timeOutStage(returnStatus, 3));
       }
-      if (returnStatus != MR_DATA_NACK)
+    }
+    if (registerBytes)
+    {
+      returnStatus = _sendByte(registerAddress & 0xFF);
+      if (returnStatus)
       {
-        return (returnStatus);
+        return (timeOutStage(returnStatus, 3));
       }
     }
-    else
+    for (uint16_t i = 0; i < txLen; i++)
     {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
+      returnStatus = _sendByte((flags & TRANSFER_FLASH) ? pgm_read_byte(txData + i) : txData[i]);
+      if (returnStatus)
       {
-        return (6);
+        return (timeOutStage(returnStatus, 3));
       }
-      if (returnStatus != MR_DATA_ACK)
+    }
+    if (rxLen)
+    {
+      returnStatus = _start();
+      if (returnStatus)
       {
-        return (returnStatus);
+        return (timeOutStage(returnStatus, 4));
       }
     }
-    dataBuffer[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
   }
-  returnStatus = _stop();
-  if (returnStatus)
+  if (rxLen)
   {
-    if (returnStatus == 1)
+    bytesAvailable = 0;
+    bufferIndex = 0;
+    returnStatus = _sendAddress(SLA_R(address));
+    if (returnStatus)
     {
-      return (7);
+      return (timeOutStage(returnStatus, 5));
     }
-    return (returnStatus);
-  }
-  return (returnStatus);
-}
-
-////////// 16-Bit Methods ///////////
-
-//These functions will be used to write to Slaves that take 16-bit addresses
-uint8_t I2C::write16(uint8_t address, uint16_t registerAddress)
-{
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
+    uint16_t nack = rxLen - 1;
+    uint16_t i;
+    uint8_t fill = 0;
+    for (i = 0; i < rxLen; i++)
     {
-      return (2);
+      returnStatus = _receiveByte(i != nack);
+      if (returnStatus != ((i == nack) ? MR_DATA_NACK : MR_DATA_ACK))
+      {
+        break;
+      }
+      if (flags & TRANSFER_STREAM)
+      {
+        //SCL is held low until the next byte is asked for, so the
+        //callback can take its time
+        rxData[fill++] = RECEIVED_BYTE;
+        if ((fill == streamChunk) || (i == nack))
+        {
+          streamCallback(rxData, fill);
+          fill = 0;
+        }
+      }
+      else if (rxData)
+      {
+        rxData[i] = RECEIVED_BYTE;
+      }
     }
-    return (returnStatus);
-  }
-  //Send MSB of register address
-  returnStatus = _sendByte(registerAddress >> 8);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
+    //only the internal buffer is handed out through receive()
+    if (rxData && (rxData == data) && !(flags & TRANSFER_STREAM))
     {
-      return (3);
+      bytesAvailable = i;
+      totalBytes = i;
     }
-    return (returnStatus);
-  }
-  //Send LSB of register address
-  returnStatus = _sendByte(registerAddress & 0xFF);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
+    if (i < rxLen)
     {
-      return (3);
+      return (timeOutStage(returnStatus, 6));
     }
-    return (returnStatus);
   }
-  returnStatus = _stop();
-  if (returnStatus)
+  if (flags & TRANSFER_STOP)
   {
-    if (returnStatus == 1)
+    returnStatus = _stop();
+    if (returnStatus)
     {
-      return (7);
+      return (timeOutStage(returnStatus, 7));
     }
-    return (returnStatus);
   }
-  return (returnStatus);
+  return (0);
 }
-uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, uint8_t data)
+#endif
+
+#if I2C_STATS
+//The return value of _transfer() alone tells where a transaction failed
+void I2C::_countTransfer(uint8_t status, uint16_t numberBytes, uint32_t elapsed)
 {
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  //Send MSB of register address
-  returnStatus = _sendByte(registerAddress >> 8);
-  if (returnStatus)
+  statistics.transactions++;
+  statistics.totalMicros += elapsed;
+  if (elapsed < statistics.minMicros)
   {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
+    statistics.minMicros = elapsed;
   }
-  //Send LSB of register address
-  returnStatus = _sendByte(registerAddress & 0xFF);
-  if (returnStatus)
+  if (elapsed > statistics.maxMicros)
   {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
+    statistics.maxMicros = elapsed;
   }
-  returnStatus = _sendByte(data);
-  if (returnStatus)
+  switch (status)
   {
-    if (returnStatus == 1)
+  case 0:
+    statistics.bytes += numberBytes;
+    break;
+  case MT_SLA_NACK:
+    statistics.nacks[2 - 1]++;
+    break;
+  case MT_DATA_NACK:
+    statistics.nacks[3 - 1]++;
+    break;
+  case MR_SLA_NACK:
+    statistics.nacks[5 - 1]++;
+    break;
+  case LOST_ARBTRTN:
+    statistics.arbitrationLost++;
+    break;
+  default:
+    if (status <= 7)
     {
-      return (3);
+      statistics.timeOuts[status - 1]++;
     }
-    return (returnStatus);
+    break;
   }
-  returnStatus = _stop();
-  if (returnStatus)
+}
+#endif
+
+#if I2C_BACKEND == I2C_BACKEND_TWI
+//recover is only set by the timeouts. After an arbitration loss or a bus
+//error the lines are low because another master is using them, clocking
+//them by hand would break its transfer.
+void I2C::lockUp(uint8_t recover)
+{
+#if I2C_STATS
+  statistics.lockUps++;
+#endif
+  TWI(TWCR) = 0; //releases SDA and SCL lines to high impedance
+  if (recover && ((TWI_PINS & TWI_LINES) != TWI_LINES))
   {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
+    //a slave is still holding the bus, reinitializing alone won't free it
+    recoverBus();
+    return;
   }
-  return (returnStatus);
+  TWI(TWCR) = _BV(TWEN) | _BV(TWEA) | SLAVE_LISTEN; //reinitialize TWI
 }
-uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, const char *data)
+#endif
+
+#if I2C_BACKEND == I2C_BACKEND_SAMD
+//////////// SAMD21 BACKEND, a SERCOM in I2C master mode with the DMAC moving
+//the bytes of the longer blocks. The bus events are mapped onto the TWI
+//status codes so everything above _transferPhases() is shared.
+#define I2C_PASTE(a, b, c) a##b##c
+#define I2C_NAME(a, b, c) I2C_PASTE(a, b, c)
+#define I2C_SERCOM I2C_NAME(SERCOM, I2C_SAMD_SERCOM, )
+#define I2C_SERCOM_GCLK_ID I2C_NAME(SERCOM, I2C_SAMD_SERCOM, _GCLK_ID_CORE)
+#define I2C_SERCOM_APBC I2C_NAME(PM_APBCMASK_SERCOM, I2C_SAMD_SERCOM, )
+#define I2C_SERCOM_DMA_TX I2C_NAME(SERCOM, I2C_SAMD_SERCOM, _DMAC_ID_TX)
+#define I2C_SERCOM_DMA_RX I2C_NAME(SERCOM, I2C_SAMD_SERCOM, _DMAC_ID_RX)
+#define I2CM (I2C_SERCOM->I2CM)
+
+//CTRLB.CMD and STATUS.BUSSTATE values
+#define I2CM_CMD_READ 2 //ACK or NACK (CTRLB.ACKACT) then read a byte
+#define I2CM_CMD_STOP 3 //ACK or NACK then stop
+#define I2CM_BUS_IDLE 1
+#define I2CM_BUS_OWNER 2
+#define I2CM_BUS_ERRORS (SERCOM_I2CM_STATUS_ARBLOST | SERCOM_I2CM_STATUS_BUSERR)
+
+#define LINE_PORT(pin) (PORT->Group[g_APinDescription[pin].ulPort])
+#define LINE_BIT(pin) (g_APinDescription[pin].ulPin)
+#define LINE_MASK(pin) (1UL << LINE_BIT(pin))
+
+//The DMAC wants the descriptors of channels 0 up to the one used
+static DmacDescriptor dmaDescriptors[I2C_SAMD_DMA_CHANNEL + 1] __attribute__((aligned(16)));
+static DmacDescriptor dmaWriteBack[I2C_SAMD_DMA_CHANNEL + 1] __attribute__((aligned(16)));
+
+static inline void sercomSync()
 {
-  uint8_t bufferLength = strlen(data);
-  returnStatus = 0;
-  returnStatus = write16(address, registerAddress, (const uint8_t *)data, bufferLength);
-  return (returnStatus);
+  while (I2CM.SYNCBUSY.bit.SYSOP)
+    ;
 }
-uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, const uint8_t *data, uint8_t numberBytes)
+
+//Open-drain control of a bus line, as for the TWI. Releasing a line also
+//takes it away from the SERCOM so it can be read.
+static void lineLow(uint32_t pin)
 {
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  //Send MSB of register address
-  returnStatus = _sendByte(registerAddress >> 8);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  //Send LSB of register address
-  returnStatus = _sendByte(registerAddress & 0xFF);
-  if (returnStatus)
+  LINE_PORT(pin).OUTCLR.reg = LINE_MASK(pin);
+  LINE_PORT(pin).DIRSET.reg = LINE_MASK(pin);
+}
+
+static void lineRelease(uint32_t pin, uint8_t pullups)
+{
+  LINE_PORT(pin).DIRCLR.reg = LINE_MASK(pin);
+  if (pullups)
   {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
+    LINE_PORT(pin).OUTSET.reg = LINE_MASK(pin);
   }
-  for (uint8_t i = 0; i < numberBytes; i++)
+  LINE_PORT(pin).PINCFG[LINE_BIT(pin)].reg = PORT_PINCFG_INEN | (pullups ? PORT_PINCFG_PULLEN : 0);
+}
+
+static uint8_t lineHigh(uint32_t pin)
+{
+  return ((LINE_PORT(pin).IN.reg & LINE_MASK(pin)) != 0);
+}
+
+static void clockRelease(uint8_t pullups)
+{
+  lineRelease(I2C_SAMD_SCL, pullups);
+  for (uint16_t i = 0; (i < RECOVER_STRETCH_LIMIT) && !lineHigh(I2C_SAMD_SCL); i++)
   {
-    returnStatus = _sendByte(data[i]);
-    if (returnStatus)
-    {
-      if (returnStatus == 1)
-      {
-        return (3);
-      }
-      return (returnStatus);
-    }
+    delayMicroseconds(1);
   }
-  returnStatus = _stop();
-  if (returnStatus)
+  delayMicroseconds(RECOVER_HALF_PERIOD);
+}
+
+//Hands both lines back to the SERCOM, the pull-ups are kept
+static void linesAttach()
+{
+  pinPeripheral(I2C_SAMD_SDA, g_APinDescription[I2C_SAMD_SDA].ulPinType);
+  pinPeripheral(I2C_SAMD_SCL, g_APinDescription[I2C_SAMD_SCL].ulPinType);
+}
+
+static void linePull(uint32_t pin, uint8_t activate)
+{
+  if (activate)
   {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
+    LINE_PORT(pin).OUTSET.reg = LINE_MASK(pin);
   }
-  return (returnStatus);
+  LINE_PORT(pin).PINCFG[LINE_BIT(pin)].bit.PULLEN = activate ? 1 : 0;
 }
-uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, uint16_t data)
+
+void I2C::begin()
 {
-  //Array to hold the 2 bytes that will be written to the register
-  uint8_t writeBytes[2];
-  returnStatus = 0;
+  PM->APBCMASK.reg |= I2C_SERCOM_APBC;
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID(I2C_SERCOM_GCLK_ID) | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_CLKEN;
+  while (GCLK->STATUS.bit.SYNCBUSY)
+    ;
+  linesAttach();
+  pullup(1);
 
-  writeBytes[0] = (data >> 8) & 0xFF; //MSB
-  writeBytes[1] = data & 0xFF;        //LSB
+  setClock(100000);
+  _dmaBegin();
+}
 
-  returnStatus = write16(address, registerAddress, writeBytes, 2);
-  return (returnStatus);
+void I2C::end()
+{
+  I2CM.CTRLA.bit.ENABLE = 0;
+  while (I2CM.SYNCBUSY.bit.ENABLE)
+    ;
 }
 
-uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, uint32_t data)
+//SCL = F_CPU / (10 + 2 * BAUD), rise time aside. BAUD is rounded up so the
+//bus is never run faster than asked. Returns the actual rate.
+uint32_t I2C::setClock(uint32_t hz)
 {
-  //Array to hold the 4 bytes that will be written to the register
-  uint8_t writeBytes[4];
-  returnStatus = 0;
+  if (!hz)
+  {
+    hz = 1;
+  }
+  uint32_t cycles = (F_CPU + hz - 1) / hz;
+  uint32_t bitRate = (cycles <= 10) ? 0 : (cycles - 10 + 1) / 2;
+  if (bitRate > 0xFF)
+  {
+    bitRate = 0xFF;
+  }
+  baud = bitRate;
+  clockRate = F_CPU / (10 + 2 * bitRate);
+  //BAUD can only be written with the SERCOM off
+  _sercomEnable();
+  _updateTimeOut();
+  return (clockRate);
+}
 
-  writeBytes[0] = (data >> 24) & 0xFF; //MSB
-  writeBytes[1] = (data >> 16) & 0xFF;
-  writeBytes[2] = (data >> 8) & 0xFF;
-  writeBytes[3] = data & 0xFF; //LSB
+void I2C::pullup(uint8_t activate)
+{
+  pullups = activate;
+  linePull(I2C_SAMD_SDA, activate);
+  linePull(I2C_SAMD_SCL, activate);
+}
 
-  returnStatus = write16(address, registerAddress, writeBytes, 4);
-  return (returnStatus);
+//Same procedure as on the TWI, with the lines taken off the SERCOM
+uint8_t I2C::recoverBus()
+{
+  I2CM.CTRLA.bit.ENABLE = 0;
+  while (I2CM.SYNCBUSY.bit.ENABLE)
+    ;
+  lineRelease(I2C_SAMD_SDA, pullups);
+  clockRelease(pullups);
+  //nothing can be clocked out while a slave holds SCL itself
+  if (lineHigh(I2C_SAMD_SCL))
+  {
+    for (uint8_t i = 0; (i < 9) && !lineHigh(I2C_SAMD_SDA); i++)
+    {
+      lineLow(I2C_SAMD_SCL);
+      delayMicroseconds(RECOVER_HALF_PERIOD);
+      clockRelease(pullups);
+    }
+    //STOP: SDA rises while SCL is high
+    lineLow(I2C_SAMD_SCL);
+    delayMicroseconds(RECOVER_HALF_PERIOD);
+    lineLow(I2C_SAMD_SDA);
+    delayMicroseconds(RECOVER_HALF_PERIOD);
+    clockRelease(pullups);
+    lineRelease(I2C_SAMD_SDA, pullups);
+    delayMicroseconds(RECOVER_HALF_PERIOD);
+  }
+  uint8_t held = !lineHigh(I2C_SAMD_SDA) || !lineHigh(I2C_SAMD_SCL);
+#if I2C_STATS
+  statistics.recoveries++;
+  if (held)
+  {
+    statistics.recoverFails++;
+  }
+#endif
+  linesAttach();
+  _sercomEnable();
+  return (held);
 }
 
-uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, uint64_t data)
+//////////// LOW-LEVEL METHODS
+//The start goes out with the address, writing ADDR while the bus is owned
+//sends a repeated start (after the ACK or NACK of a pending read byte)
+uint8_t I2C::_start()
 {
-  //Array to hold the 8 bytes that will be written to the register
-  uint8_t writeBytes[8];
-  returnStatus = 0;
+  return (0);
+}
 
-  writeBytes[0] = (data >> 56) & 0xFF; //MSB
-  writeBytes[1] = (data >> 48) & 0xFF;
-  writeBytes[2] = (data >> 40) & 0xFF;
-  writeBytes[3] = (data >> 32) & 0xFF;
-  writeBytes[4] = (data >> 24) & 0xFF;
-  writeBytes[5] = (data >> 16) & 0xFF;
-  writeBytes[6] = (data >> 8) & 0xFF;
-  writeBytes[7] = data & 0xFF; //LSB
+uint8_t I2C::_sendAddress(uint8_t i2cAddress)
+{
+  rxPending = 0;
+  I2CM.ADDR.reg = SERCOM_I2CM_ADDR_ADDR(i2cAddress);
+  sercomSync();
+  //an ACKed SLA+R clocks in the first byte straight away
+  if (_sercomWait(SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_SB))
+  {
+    return (1);
+  }
+  uint8_t status = _sercomStatus((i2cAddress & 0x01) ? MR_SLA_NACK : MT_SLA_NACK);
+  if (!status && (i2cAddress & 0x01))
+  {
+    rxPending = 1;
+  }
+  return (status);
+}
 
-  returnStatus = write16(address, registerAddress, writeBytes, 8);
-  return (returnStatus);
+uint8_t I2C::_sendByte(uint8_t i2cData)
+{
+  I2CM.DATA.reg = i2cData;
+  sercomSync();
+  if (_sercomWait(SERCOM_I2CM_INTFLAG_MB))
+  {
+    return (1);
+  }
+  return (_sercomStatus(MT_DATA_NACK));
 }
-//These functions will be used to read from Slaves that take 16-bit addresses
-uint8_t I2C::read16(uint8_t address, uint16_t registerAddress, uint8_t numberBytes)
+
+//The ACK or NACK of a byte is only sent with the next command, ack is kept
+//in CTRLB.ACKACT until then
+uint8_t I2C::_receiveByte(uint8_t ack)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  numberBytes = min(numberBytes, MAX_BUFFER_SIZE);
-  if (numberBytes == 0)
+  if (!rxPending)
   {
-    numberBytes++;
+    _sercomCommand(I2CM_CMD_READ);
   }
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
+  rxPending = 0;
+  if (_sercomWait(SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_SB))
   {
-    return (returnStatus);
+    return (1);
   }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
+  if (I2CM.STATUS.reg & I2CM_BUS_ERRORS)
   {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
+    lockUp(0);
+    return (LOST_ARBTRTN);
   }
-  //Send MSB of register address
-  returnStatus = _sendByte(registerAddress >> 8);
-  if (returnStatus)
+  I2CM.CTRLB.bit.ACKACT = ack ? 0 : 1;
+  lastByte = I2CM.DATA.reg;
+  return (ack ? MR_DATA_ACK : MR_DATA_NACK);
+}
+
+uint8_t I2C::_receiveByte(uint8_t ack, uint8_t *target)
+{
+  uint8_t stat = I2C::_receiveByte(ack);
+  if (stat == 1)
   {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
+    return (6);
   }
-  //Send LSB of register address
-  returnStatus = _sendByte(registerAddress & 0xFF);
-  if (returnStatus)
+  if (stat != (ack ? MR_DATA_ACK : MR_DATA_NACK))
   {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
+    *target = 0x0;
+    return (stat);
   }
-  returnStatus = _start();
-  if (returnStatus)
+  *target = lastByte;
+  return 0;
+}
+
+uint8_t I2C::_stop()
+{
+  rxPending = 0;
+  _sercomCommand(I2CM_CMD_STOP);
+  uint32_t spins = timeOutSpins;
+  while (I2CM.STATUS.bit.BUSSTATE == I2CM_BUS_OWNER)
   {
-    if (returnStatus == 1)
+    if (spins && !--spins)
     {
-      return (4);
+      lockUp(1);
+      return (1);
     }
-    return (returnStatus);
   }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
+  return (0);
+}
+
+//Resets the SERCOM into master mode at the current BAUD. The bus state is
+//unknown after a reset and nothing is sent until it is forced to idle.
+void I2C::_sercomEnable()
+{
+  I2CM.CTRLA.bit.SWRST = 1;
+  while (I2CM.CTRLA.bit.SWRST || I2CM.SYNCBUSY.bit.SWRST)
+    ;
+  I2CM.CTRLA.reg = SERCOM_I2CM_CTRLA_MODE_I2C_MASTER;
+  I2CM.BAUD.reg = SERCOM_I2CM_BAUD_BAUD(baud);
+  I2CM.CTRLA.bit.ENABLE = 1;
+  while (I2CM.SYNCBUSY.bit.ENABLE)
+    ;
+  I2CM.STATUS.bit.BUSSTATE = I2CM_BUS_IDLE;
+  sercomSync();
+  rxPending = 0;
+}
+
+void I2C::_sercomCommand(uint8_t command)
+{
+  I2CM.CTRLB.bit.CMD = command;
+  sercomSync();
+}
+
+//Waits for any of the INTFLAG bits in flags, 1 on timeout
+uint8_t I2C::_sercomWait(uint8_t flags)
+{
+  uint32_t spins = timeOutSpins;
+  while (!(I2CM.INTFLAG.reg & flags))
   {
-    if (returnStatus == 1)
+    if (spins && !--spins)
     {
-      return (5);
+      lockUp(1);
+      return (1);
     }
-    return (returnStatus);
   }
-  for (uint8_t i = 0; i < numberBytes; i++)
+  return (0);
+}
+
+//Turns the STATUS of the step just done into its TWI code, nack being the
+//code for a NACK at that step
+uint8_t I2C::_sercomStatus(uint8_t nack)
+{
+  uint16_t status = I2CM.STATUS.reg;
+  if (status & I2CM_BUS_ERRORS)
   {
-    if (i == nack)
-    {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_NACK)
-      {
-        return (returnStatus);
-      }
-    }
-    else
-    {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_ACK)
-      {
-        return (returnStatus);
-      }
-    }
-    data[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
+    lockUp(0);
+    return (LOST_ARBTRTN);
   }
-  returnStatus = _stop();
-  if (returnStatus)
+  if (status & SERCOM_I2CM_STATUS_RXNACK)
   {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
+    _stop();
+    return (nack);
   }
-  return (returnStatus);
+  return (0);
 }
-uint8_t I2C::read16(uint8_t address, uint16_t registerAddress, uint8_t numberBytes, uint8_t *dataBuffer)
+
+//The DMAC has a single descriptor table, if another library has already
+//set it up the bytes are left to the CPU
+void I2C::_dmaBegin()
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  if (numberBytes == 0)
+  if (dmaReady || DMAC->CTRL.bit.DMAENABLE)
   {
-    numberBytes++;
+    return;
   }
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
+  PM->AHBMASK.reg |= PM_AHBMASK_DMAC;
+  PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
+  DMAC->BASEADDR.reg = (uint32_t)dmaDescriptors;
+  DMAC->WRBADDR.reg = (uint32_t)dmaWriteBack;
+  DMAC->CTRL.reg = DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xF);
+  dmaReady = 1;
+}
+
+//Moves beats bytes between memory and DATA, one per trigger of the SERCOM.
+//Stops early when the slave NACKs or the bus is lost, the caller picks the
+//reason up from STATUS. The timeout budget is one per byte. 1 on timeout.
+uint8_t I2C::_dmaTransfer(const volatile void *source, volatile void *destination, uint16_t beats, uint8_t trigger, uint16_t increment)
+{
+  DmacDescriptor &descriptor = dmaDescriptors[I2C_SAMD_DMA_CHANNEL];
+  descriptor.BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE | increment;
+  descriptor.BTCNT.reg = beats;
+  //an incrementing address is given as the end of the block
+  descriptor.SRCADDR.reg = (uint32_t)source + ((increment & DMAC_BTCTRL_SRCINC) ? beats : 0);
+  descriptor.DSTADDR.reg = (uint32_t)destination + ((increment & DMAC_BTCTRL_DSTINC) ? beats : 0);
+  descriptor.DESCADDR.reg = 0;
+  DMAC->CHID.reg = DMAC_CHID_ID(I2C_SAMD_DMA_CHANNEL);
+  DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+  while (DMAC->CHCTRLA.bit.SWRST)
+    ;
+  DMAC->CHCTRLB.reg = DMAC_CHCTRLB_TRIGSRC(trigger) | DMAC_CHCTRLB_TRIGACT_BEAT;
+  DMAC->CHCTRLA.reg = DMAC_CHCTRLA_ENABLE;
+  uint32_t spins = (timeOutSpins > UINT32_MAX / beats) ? UINT32_MAX : timeOutSpins * beats;
+  uint8_t timedOut = 0;
+  while (!(DMAC->CHINTFLAG.reg & (DMAC_CHINTFLAG_TCMPL | DMAC_CHINTFLAG_TERR)))
+  {
+    if (I2CM.STATUS.reg & (SERCOM_I2CM_STATUS_RXNACK | I2CM_BUS_ERRORS))
+    {
+      break;
+    }
+    if (spins && !--spins)
+    {
+      timedOut = 1;
+      break;
+    }
+  }
+  DMAC->CHCTRLA.reg = 0;
+  while (DMAC->CHCTRLA.bit.ENABLE)
+    ;
+  DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_MASK;
+  if (timedOut)
+  {
+    lockUp(1);
+    return (1);
+  }
+  return (0);
+}
+
+uint8_t I2C::_dmaWrite(const uint8_t *txData, uint16_t numberBytes)
+{
+  if (_dmaTransfer(txData, &I2CM.DATA.reg, numberBytes, I2C_SERCOM_DMA_TX, DMAC_BTCTRL_SRCINC))
   {
-    return (returnStatus);
+    return (1);
   }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
+  //the last byte is still being shifted out when the DMAC is done
+  if (_sercomWait(SERCOM_I2CM_INTFLAG_MB))
   {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
+    return (1);
   }
-  //Send MSB of register address
-  returnStatus = _sendByte(registerAddress >> 8);
-  if (returnStatus)
+  return (_sercomStatus(MT_DATA_NACK));
+}
+
+//In smart mode reading DATA ACKs the byte and clocks in the next one, so
+//the byte after the block is left pending for _receiveByte() to NACK
+uint8_t I2C::_dmaRead(uint8_t *rxData, uint16_t numberBytes)
+{
+  if (!rxPending)
   {
-    if (returnStatus == 1)
+    _sercomCommand(I2CM_CMD_READ);
+    if (_sercomWait(SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_SB))
     {
-      return (3);
+      return (1);
     }
-    return (returnStatus);
   }
-  //Send LSB of register address
-  returnStatus = _sendByte(registerAddress & 0xFF);
-  if (returnStatus)
+  I2CM.CTRLB.reg = SERCOM_I2CM_CTRLB_SMEN;
+  uint8_t status = _dmaTransfer(&I2CM.DATA.reg, rxData, numberBytes, I2C_SERCOM_DMA_RX, DMAC_BTCTRL_DSTINC);
+  I2CM.CTRLB.reg = 0;
+  if (status)
   {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
+    return (1);
   }
-  returnStatus = _start();
-  if (returnStatus)
+  if (I2CM.STATUS.reg & I2CM_BUS_ERRORS)
   {
-    if (returnStatus == 1)
-    {
-      return (4);
-    }
-    return (returnStatus);
+    lockUp(0);
+    return (LOST_ARBTRTN);
   }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
+  rxPending = 1;
+  return (0);
+}
+
+//Same phases as the TWI one, blocks of I2C_DMA_THRESHOLD bytes or more go
+//through the DMAC. There is no separate start, a timeout waiting for the
+//bus shows up as the address stage (2 or 5).
+uint8_t I2C::_transferPhases(uint8_t address, uint16_t registerAddress, uint8_t registerBytes, const uint8_t *txData, uint16_t txLen, uint8_t *rxData, uint16_t rxLen, uint8_t flags)
+{
+  if (registerBytes || txLen || !rxLen)
   {
-    if (returnStatus == 1)
+    returnStatus = _sendAddress(SLA_W(address));
+    if (returnStatus)
     {
-      return (5);
+      return (timeOutStage(returnStatus, 2));
     }
-    return (returnStatus);
-  }
-  for (uint8_t i = 0; i < numberBytes; i++)
-  {
-    if (i == nack)
+    if (registerBytes == 2)
     {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
+      //Send MSB of register address
+      returnStatus = _sendByte(registerAddress >> 8);
+      if (returnStatus)
       {
-        return (6);
+        return (timeOutStage(returnStatus, 3));
       }
-      if (returnStatus != MR_DATA_NACK)
+    }
+    if (registerBytes)
+    {
+      returnStatus = _sendByte(registerAddress & 0xFF);
+      if (returnStatus)
       {
-        return (returnStatus);
+        return (timeOutStage(returnStatus, 3));
       }
     }
-    else
+    //flash is memory mapped, TRANSFER_FLASH needs no special treatment
+    if (dmaReady && txLen && (txLen >= I2C_DMA_THRESHOLD))
     {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
+      returnStatus = _dmaWrite(txData, txLen);
+      if (returnStatus)
       {
-        return (6);
+        return (timeOutStage(returnStatus, 3));
       }
-      if (returnStatus != MR_DATA_ACK)
+    }
+    else
+    {
+      for (uint16_t i = 0; i < txLen; i++)
       {
-        return (returnStatus);
+        returnStatus = _sendByte(txData[i]);
+        if (returnStatus)
+        {
+          return (timeOutStage(returnStatus, 3));
+        }
       }
     }
-    dataBuffer[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
   }
-  returnStatus = _stop();
-  if (returnStatus)
+  if (rxLen)
   {
-    if (returnStatus == 1)
+    bytesAvailable = 0;
+    bufferIndex = 0;
+    returnStatus = _sendAddress(SLA_R(address));
+    if (returnStatus)
     {
-      return (7);
+      return (timeOutStage(returnStatus, 5));
     }
-    return (returnStatus);
-  }
-  return (returnStatus);
-}
-
-//////////// LOW-LEVEL METHODS (No need to use them if the device uses normal register protocal)
-uint8_t I2C::_start()
-{
-  unsigned long startingTime = millis();
-  TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN);
-  while (!(TWCR & (1 << TWINT)))
-  {
-    if (!timeOutDelay)
+    uint16_t nack = rxLen - 1;
+    uint16_t i = 0;
+    uint8_t fill = 0;
+    while (i < rxLen)
     {
-      continue;
+      uint8_t *target = (flags & TRANSFER_STREAM) ? rxData + fill : (rxData ? rxData + i : NULL);
+      //the last byte is always left to the CPU, it has to be NACKed
+      uint16_t block = nack - i;
+      if ((flags & TRANSFER_STREAM) && (block > (uint16_t)(streamChunk - fill)))
+      {
+        block = streamChunk - fill;
+      }
+      if (target && dmaReady && block && (block >= I2C_DMA_THRESHOLD))
+      {
+        returnStatus = _dmaRead(target, block);
+        if (returnStatus)
+        {
+          break;
+        }
+        i += block;
+        fill += block;
+      }
+      else
+      {
+        returnStatus = _receiveByte(i != nack);
+        if (returnStatus != ((i == nack) ? MR_DATA_NACK : MR_DATA_ACK))
+        {
+          break;
+        }
+        if (target)
+        {
+          *target = lastByte;
+        }
+        i++;
+        fill++;
+      }
+      if ((flags & TRANSFER_STREAM) && ((fill == streamChunk) || (i == rxLen)))
+      {
+        //SCL is held low after the next byte, the callback can take its time
+        streamCallback(rxData, fill);
+        fill = 0;
+      }
     }
-    if ((millis() - startingTime) >= timeOutDelay)
+    //only the internal buffer is handed out through receive()
+    if (rxData && (rxData == data) && !(flags & TRANSFER_STREAM))
     {
-      lockUp();
-      return (1);
+      bytesAvailable = i;
+      totalBytes = i;
+    }
+    if (i < rxLen)
+    {
+      return (timeOutStage(returnStatus, 6));
     }
   }
-  if ((TWI_STATUS == START) || (TWI_STATUS == REPEATED_START))
-  {
-    return (0);
-  }
-  if (TWI_STATUS == LOST_ARBTRTN)
+  if (flags & TRANSFER_STOP)
   {
-    uint8_t bufferedStatus = TWI_STATUS;
-    lockUp();
-    return (bufferedStatus);
+    returnStatus = _stop();
+    if (returnStatus)
+    {
+      return (timeOutStage(returnStatus, 7));
+    }
   }
-  return (TWI_STATUS);
+  return (0);
+}
+
+//Same rule as on the TWI, only a timeout recovers the bus
+void I2C::lockUp(uint8_t recover)
+{
+#if I2C_STATS
+  statistics.lockUps++;
+#endif
+  //the lines can only be read with the SERCOM off and the pins taken off it
+  I2CM.CTRLA.bit.ENABLE = 0;
+  while (I2CM.SYNCBUSY.bit.ENABLE)
+    ;
+  lineRelease(I2C_SAMD_SDA, pullups);
+  lineRelease(I2C_SAMD_SCL, pullups);
+  if (recover && (!lineHigh(I2C_SAMD_SDA) || !lineHigh(I2C_SAMD_SCL)))
+  {
+    //a slave is still holding the bus, reinitializing alone won't free it
+    recoverBus();
+    return;
+  }
+  linesAttach();
+  _sercomEnable();
+}
+#endif
+
+#if I2C_BACKEND == I2C_BACKEND_HOST
+//////////// HOST BACKEND, simulated slaves on a virtual clock. Time only moves
+//with the bus (and delay()), so the figures of a benchmark are exact and the
+//same on every run.
+static uint64_t hostNanos = 0;
+I2CHostSerial Serial;
+
+unsigned long micros()
+{
+  return (hostNanos / 1000);
+}
+
+unsigned long millis()
+{
+  return (hostNanos / 1000000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  hostNanos += us * 1000ULL;
+}
+
+void delay(unsigned long ms)
+{
+  hostNanos += ms * 1000000ULL;
+}
+
+void I2C::begin()
+{
+  setClock(100000);
+}
+
+void I2C::end()
+{
+  current = NULL;
+}
+
+uint32_t I2C::setClock(uint32_t hz)
+{
+  clockRate = hz ? hz : 1;
+  _updateTimeOut();
+  return (clockRate);
+}
+
+//the simulated bus has no pull-ups to switch
+void I2C::pullup(uint8_t)
+{
+}
+
+uint8_t I2C::recoverBus()
+{
+  current = NULL;
+#if I2C_STATS
+  statistics.recoveries++;
+#endif
+  return (0);
+}
+
+//Models are searched newest first, a second model at an address hides the first
+void I2C::attachModel(I2CModel *model)
+{
+  model->pointer = 0;
+  model->phase = 0;
+  model->next = models;
+  models = model;
+}
+
+void I2C::detachModels()
+{
+  models = NULL;
+  current = NULL;
+}
+
+const I2CBusCounters &I2C::busCounters()
+{
+  return (counters);
+}
+
+void I2C::resetBusCounters()
+{
+  memset(&counters, 0, sizeof(counters));
+}
+
+//////////// LOW-LEVEL METHODS
+uint8_t I2C::_start()
+{
+  _busTime(1);
+  counters.starts++;
+  return (0);
 }
 
 uint8_t I2C::_sendAddress(uint8_t i2cAddress)
 {
-  TWDR = i2cAddress;
-  unsigned long startingTime = millis();
-  TWCR = (1 << TWINT) | (1 << TWEN);
-  while (!(TWCR & (1 << TWINT)))
+  _busTime(9);
+  current = NULL;
+  for (I2CModel *model = models; model; model = model->next)
   {
-    if (!timeOutDelay)
-    {
-      continue;
-    }
-    if ((millis() - startingTime) >= timeOutDelay)
+    if ((model->address == (i2cAddress >> 1)) && !model->nackAddress)
     {
-      lockUp();
-      return (1);
+      current = model;
+      break;
     }
   }
-  if ((TWI_STATUS == MT_SLA_ACK) || (TWI_STATUS == MR_SLA_ACK))
-  {
-    return (0);
-  }
-  uint8_t bufferedStatus = TWI_STATUS;
-  if ((TWI_STATUS == MT_SLA_NACK) || (TWI_STATUS == MR_SLA_NACK))
+  reading = i2cAddress & 0x01;
+  if (!current)
   {
     _stop();
-    return (bufferedStatus);
-  }
-  else
-  {
-    lockUp();
-    return (bufferedStatus);
+    return (reading ? MR_SLA_NACK : MT_SLA_NACK);
   }
+  current->phase = 0;
+  return (0);
 }
 
 uint8_t I2C::_sendByte(uint8_t i2cData)
 {
-  TWDR = i2cData;
-  unsigned long startingTime = millis();
-  TWCR = (1 << TWINT) | (1 << TWEN);
-  while (!(TWCR & (1 << TWINT)))
+  _busTime(9);
+  if (!current || reading)
   {
-    if (!timeOutDelay)
-    {
-      continue;
-    }
-    if ((millis() - startingTime) >= timeOutDelay)
-    {
-      lockUp();
-      return (1);
-    }
+    lockUp(0);
+    return (LOST_ARBTRTN);
   }
-  if (TWI_STATUS == MT_DATA_ACK)
+  if (current->phase < current->registerBytes)
   {
+    current->pointer = current->phase ? (current->pointer << 8) | i2cData : i2cData;
+    current->phase++;
     return (0);
   }
-  uint8_t bufferedStatus = TWI_STATUS;
-  if (TWI_STATUS == MT_DATA_NACK)
+  uint8_t nack = 0;
+  if (current->onWrite)
   {
-    _stop();
-    return (bufferedStatus);
+    nack = current->onWrite(current, current->pointer, i2cData);
   }
-  else
+  else if (current->pointer < current->size)
   {
-    lockUp();
-    return (bufferedStatus);
+    current->registers[current->pointer] = i2cData;
+  }
+  current->pointer++;
+  if (nack)
+  {
+    _stop();
+    return (MT_DATA_NACK);
   }
+  return (0);
 }
 
 uint8_t I2C::_receiveByte(uint8_t ack)
 {
-  unsigned long startingTime = millis();
-  if (ack)
-  {
-    TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWEA);
-  }
-  else
+  _busTime(9);
+  if (!current || !reading)
   {
-    TWCR = (1 << TWINT) | (1 << TWEN);
+    lockUp(0);
+    return (LOST_ARBTRTN);
   }
-  while (!(TWCR & (1 << TWINT)))
+  if (current->onRead)
   {
-    if (!timeOutDelay)
-    {
-      continue;
-    }
-    if ((millis() - startingTime) >= timeOutDelay)
-    {
-      lockUp();
-      return (1);
-    }
+    lastByte = current->onRead(current, current->pointer);
   }
-  if (TWI_STATUS == LOST_ARBTRTN)
+  else
   {
-    uint8_t bufferedStatus = TWI_STATUS;
-    lockUp();
-    return (bufferedStatus);
+    lastByte = (current->pointer < current->size) ? current->registers[current->pointer] : 0xFF;
   }
-  return (TWI_STATUS);
+  current->pointer++;
+  return (ack ? MR_DATA_ACK : MR_DATA_NACK);
 }
 
 uint8_t I2C::_receiveByte(uint8_t ack, uint8_t *target)
 {
   uint8_t stat = I2C::_receiveByte(ack);
-  if (stat == 1)
+  if (stat != (ack ? MR_DATA_ACK : MR_DATA_NACK))
   {
-    return (6);
-  }
-  if (ack)
-  {
-    if (stat != MR_DATA_ACK)
-    {
-      *target = 0x0;
-      return (stat);
-    }
-  }
-  else
-  {
-    if (stat != MR_DATA_NACK)
-    {
-      *target = 0x0;
-      return (stat);
-    }
+    *target = 0x0;
+    return (stat);
   }
-  *target = TWDR;
-  // I suppose that if we get this far we're ok
+  *target = lastByte;
   return 0;
 }
 
 uint8_t I2C::_stop()
 {
-  unsigned long startingTime = millis();
-  TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
-  while ((TWCR & (1 << TWSTO)))
-  {
-    if (!timeOutDelay)
-    {
-      continue;
-    }
-    if ((millis() - startingTime) >= timeOutDelay)
-    {
-      lockUp();
-      return (1);
-    }
-  }
+  _busTime(1);
+  counters.stops++;
+  current = NULL;
   return (0);
 }
 
-/////////////// Private Methods ////////////////////////////////////////
+//Moves the virtual clock on by bits SCL periods and counts the step
+void I2C::_busTime(uint8_t bits)
+{
+  counters.bits += bits;
+  counters.steps++;
+  hostNanos += bits * 1000000000ULL / clockRate;
+}
 
-void I2C::lockUp()
+void I2C::lockUp(uint8_t)
 {
-  TWCR = 0;                     //releases SDA and SCL lines to high impedance
-  TWCR = _BV(TWEN) | _BV(TWEA); //reinitialize TWI
+#if I2C_STATS
+  statistics.lockUps++;
+#endif
+  current = NULL;
 }
+#endif
 
-I2C I2c = I2C();
+I2C I2c;
@@ -35,7 +35,8 @@
   library.  Functions were rewritten to provide more functionality
   and also the use of Repeated Start.  Some I2C devices will not
   function correctly without the use of a Repeated Start.  The 
-  initial version of this library only supports the Master.
+  initial version of this library only supports the Master, a
+  register map slave can be compiled in with I2C_SLAVE.
 
 
   This library is free software; you can redistribute it and/or
@@ -53,7 +54,46 @@
   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
-#if (ARDUINO >= 100)
+#ifndef I2C_h
+#define I2C_h
+
+#if I2C_HOST
+//Host build (-DI2C_HOST=1) against the simulated bus, with the little of
+//the Arduino core the library uses. Time is the virtual time of the bus.
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#ifndef F_CPU
+#define F_CPU 16000000UL //the timeout budget is worked out as on an Uno
+#endif
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define F(string) (string)
+#define HEX 16
+#define _BV(bit) (1 << (bit))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long);
+void delayMicroseconds(unsigned int);
+struct I2CHostSerial
+{
+  void print(const char *text) { fputs(text, stdout); }
+  void print(unsigned value, int base = 10) { printf((base == HEX) ? "%X" : "%u", value); }
+  void println(const char *text = "") { puts(text); }
+  void println(unsigned value, int base = 10)
+  {
+    print(value, base);
+    puts("");
+  }
+  size_t write(const uint8_t *buffer, size_t size) { return (fwrite(buffer, 1, size, stdout)); }
+};
+typedef I2CHostSerial Print;
+extern I2CHostSerial Serial;
+#elif (ARDUINO >= 100)
 #include <Arduino.h>
 #else
 #include <WProgram.h>
@@ -61,9 +101,6 @@
 
 #include <inttypes.h>
 
-#ifndef I2C_h
-#define I2C_h
-
 #define START 0x08
 #define REPEATED_START 0x10
 #define MT_SLA_ACK 0x18
@@ -75,24 +112,426 @@
 #define MR_DATA_ACK 0x50
 #define MR_DATA_NACK 0x58
 #define LOST_ARBTRTN 0x38
+#define SR_SLA_ACK 0x60
+#define SR_ARB_LOST_SLA_ACK 0x68
+#define SR_DATA_ACK 0x80
+#define SR_DATA_NACK 0x88
+#define SR_STOP 0xA0
+#define ST_SLA_ACK 0xA8
+#define ST_ARB_LOST_SLA_ACK 0xB0
+#define ST_DATA_ACK 0xB8
+#define ST_DATA_NACK 0xC0
+#define ST_LAST_DATA 0xC8
 #define TWI_STATUS (TWSR & 0xF8)
 #define SLA_W(address) (address << 1)
 #define SLA_R(address) ((address << 1) + 0x01)
 #define cbi(sfr, bit) (_SFR_BYTE(sfr) &= ~_BV(bit))
 #define sbi(sfr, bit) (_SFR_BYTE(sfr) |= _BV(bit))
 
-#define MAX_BUFFER_SIZE 32
+//Size of the internal buffer used by read()/read16() without a dataBuffer
+//and I2c.receive(), at most 255. It is allocated in I2C.cpp, one per bus,
+//so it has to be changed for the whole build (e.g. -DI2C_BUFFER_SIZE=6), 0
+//leaves it out completely. A sketch can also hand over its own array with
+//setBuffer(), e.g. to give a second object on the same bus one of its own.
+#ifndef I2C_BUFFER_SIZE
+#define I2C_BUFFER_SIZE 32
+#endif
+#define MAX_BUFFER_SIZE I2C_BUFFER_SIZE
+
+//Set to 1 to compile the interrupt driven (TWI_vect) asynchronous transfers.
+//Must be set for the whole build (e.g. -DI2C_ASYNC=1), not just the sketch.
+#ifndef I2C_ASYNC
+#define I2C_ASYNC 0
+#endif
+
+//Set to 1 to compile the polled begin*()/service() transfers, the same
+//state machine driven from the main loop instead of TWI_vect
+#ifndef I2C_POLLED
+#define I2C_POLLED 0
+#endif
+
+//Set to 1 to compile the register map slave driven from TWI_vect
+#ifndef I2C_SLAVE
+#define I2C_SLAVE 0
+#endif
+
+//Set to 1 to compile the Timer2 driven sampler, periodic reads started from
+//TIMER2_COMPA_vect on the asynchronous engine. Takes Timer2 from tone().
+#ifndef I2C_SAMPLER
+#define I2C_SAMPLER 0
+#endif
+#if I2C_SAMPLER && !I2C_ASYNC
+#error "I2C_SAMPLER runs on the asynchronous transfers, set I2C_ASYNC as well"
+#endif
+
+//Backend driving the bus, picked from the target unless set for the build:
+//the AVR TWI, a SAMD21 SERCOM with DMA for the longer blocks, or simulated
+//slaves on a PC
+#define I2C_BACKEND_TWI 1
+#define I2C_BACKEND_SAMD 2
+#define I2C_BACKEND_HOST 3
+#ifndef I2C_BACKEND
+#if I2C_HOST
+#define I2C_BACKEND I2C_BACKEND_HOST
+#elif defined(ARDUINO_ARCH_SAMD)
+#define I2C_BACKEND I2C_BACKEND_SAMD
+#else
+#define I2C_BACKEND I2C_BACKEND_TWI
+#endif
+#endif
+
+#if I2C_BACKEND == I2C_BACKEND_SAMD
+//SERCOM wired to the Wire pins of the variant, 0 on the MKR boards and 3 on
+//the Zero and most others
+#ifndef I2C_SAMD_SERCOM
+#if defined(ARDUINO_SAMD_MKRZERO) || defined(ARDUINO_SAMD_MKR1000) || defined(ARDUINO_SAMD_MKRWIFI1010)
+#define I2C_SAMD_SERCOM 0
+#else
+#define I2C_SAMD_SERCOM 3
+#endif
+#endif
+//Arduino pins of SDA and SCL, pinmuxed to that SERCOM
+#ifndef I2C_SAMD_SDA
+#define I2C_SAMD_SDA PIN_WIRE_SDA
+#endif
+#ifndef I2C_SAMD_SCL
+#define I2C_SAMD_SCL PIN_WIRE_SCL
+#endif
+//DMAC channel used for the data, the DMA is left alone (and the bytes moved
+//by the CPU) if another library has already set up the DMAC
+#ifndef I2C_SAMD_DMA_CHANNEL
+#define I2C_SAMD_DMA_CHANNEL 0
+#endif
+//Blocks shorter than this are not worth setting up a DMA transfer for
+#ifndef I2C_DMA_THRESHOLD
+#define I2C_DMA_THRESHOLD 8
+#endif
+#endif
+
+//Set to 1 to have the blocking calls put the CPU in SLEEP_MODE_IDLE while the
+//TWI works, woken by TWI_vect, instead of spinning on TWINT
+#ifndef I2C_SLEEP
+#define I2C_SLEEP 0
+#endif
+
+#if I2C_BACKEND == I2C_BACKEND_TWI
+//Hardware TWIs of the part, an I2C instance drives the one passed to its
+//constructor
+#if defined(__AVR_ATmega328PB__)
+#define I2C_TWI_BUSES 2
+#else
+#define I2C_TWI_BUSES 1
+#endif
+#endif
+
+#if (I2C_BACKEND != I2C_BACKEND_TWI) && (I2C_ASYNC || I2C_POLLED || I2C_SLAVE || I2C_SLEEP)
+#error "I2C_ASYNC, I2C_POLLED, I2C_SLAVE and I2C_SLEEP are only available on the AVR TWI backend"
+#endif
+
+#if I2C_BACKEND == I2C_BACKEND_HOST
+//A slave on the simulated bus of the host build, attached with attachModel().
+//By default it is a register map of size bytes behind a registerBytes wide
+//pointer that moves on with every data byte (reads past the end give 0xFF).
+//onRead and onWrite, if set, take over the data bytes, onWrite returns
+//non-zero to NACK. The fields can be changed between calls to script it.
+struct I2CModel
+{
+  uint8_t address;
+  uint8_t registerBytes;
+  uint8_t *registers;
+  uint16_t size;
+  uint8_t nackAddress; //NACK SLA+R/W while set
+  uint8_t (*onRead)(I2CModel *, uint16_t pointer);
+  uint8_t (*onWrite)(I2CModel *, uint16_t pointer, uint8_t data);
+  //kept by the library
+  uint16_t pointer;
+  uint8_t phase; //register address bytes received since SLA+W
+  I2CModel *next;
+};
+
+//What the low-level methods did on the simulated bus, for benchmarks
+struct I2CBusCounters
+{
+  uint32_t bits;  //SCL clocks, starts and stops count as one
+  uint32_t steps; //low-level operations, one register round trip each on the TWI
+  uint16_t starts;
+  uint16_t stops;
+};
+#endif
+
+//Returned by poll() and service() while a transfer is still in progress
+#define I2C_BUSY 0xFF
+//Returned by read(), read16() and transfer() without a dataBuffer when there
+//is no internal buffer (I2C_BUFFER_SIZE 0 and no setBuffer()), nothing is sent
+#define I2C_NO_BUFFER 0xFC
+
+//Set to 1 to compile the SMBus block transfers and process calls with PEC
+//(a 256 byte CRC table in flash)
+#ifndef I2C_SMBUS
+#define I2C_SMBUS 0
+#endif
+//Returned by the smbus*() calls when the PEC read back doesn't match, and
+//when a block read got more bytes than fit (the rest were dropped)
+#define I2C_PEC_ERROR 0xFE
+#define I2C_BLOCK_OVERFLOW 0xFD
+
+typedef void (*I2CCallback)(uint8_t status);
+//Told which registers the master has just written to the slave register map
+typedef void (*I2CSlaveCallback)(uint8_t firstRegister, uint8_t count);
+//Receives each chunk of readStream(), the buffer is reused for the next one
+typedef void (*I2CChunkCallback)(const uint8_t *chunk, uint8_t length);
+
+//Set to 1 to count transactions, errors and timing of the blocking calls
+#ifndef I2C_STATS
+#define I2C_STATS 0
+#endif
+
+#if I2C_STATS
+struct I2CStats
+{
+  uint32_t transactions;
+  uint32_t bytes;           //register and data bytes of successful transactions
+  uint16_t timeOuts[7];     //by stage 1 - 7, see the list above write()
+  uint16_t nacks[7];        //by the same stages, only 2, 3 and 5 can NACK
+  uint16_t arbitrationLost;
+  uint16_t lockUps;
+  uint16_t recoveries;      //recoverBus() runs, from lockUp() or the sketch
+  uint16_t recoverFails;    //runs that left the bus still held
+  uint16_t retries;         //attempts repeated by setRetries()
+  uint32_t minMicros;       //per transaction, failed ones included
+  uint32_t maxMicros;
+  uint32_t totalMicros;
+};
+#endif
+
+//Set to 1 to keep the last I2C_TRACE_SIZE transactions of the blocking
+//calls in a ring, read with trace() or sent out with dumpTrace()
+#ifndef I2C_TRACE
+#define I2C_TRACE 0
+#endif
+#ifndef I2C_TRACE_SIZE
+#define I2C_TRACE_SIZE 16
+#endif
+#if I2C_TRACE_SIZE > 255
+#error "I2C_TRACE_SIZE can be at most 255 entries"
+#endif
+
+#if I2C_TRACE
+struct I2CTraceEntry
+{
+  uint32_t time;            //millis() at the end of the transaction
+  uint8_t address;          //bit 7 set if it read from the slave
+  uint8_t status;           //as returned by the call
+  uint16_t registerAddress;
+  uint16_t length;          //data bytes written and read
+};
+#endif
+
+//Number of {address, register, value} entries of a write-through cache
+//behind write(address, register, uint8_t data), which then leaves the bus
+//alone when the register already holds data. 0 leaves it out.
+#ifndef I2C_WRITE_CACHE
+#define I2C_WRITE_CACHE 0
+#endif
+#if I2C_WRITE_CACHE > 127
+#error "I2C_WRITE_CACHE can be at most 127 entries"
+#endif
+
+//Number of addresses the presence table can track while they NACK. Once
+//setPresence() is called a device NACKing its address that many times in a
+//row is absent: calls to it fail at once, with only a slow re-probe.
+//0 leaves it out.
+#ifndef I2C_PRESENCE
+#define I2C_PRESENCE 0
+#endif
+
+//Number of devices behind TCA9548A style multiplexers that can be added with
+//addMuxDevice(), 0 leaves the channel routing out
+#ifndef I2C_MUX_DEVICES
+#define I2C_MUX_DEVICES 0
+#endif
+#if I2C_MUX_DEVICES > 128
+#error "I2C_MUX_DEVICES can be at most 128 devices"
+#endif
+
+#if I2C_MUX_DEVICES
+//A TCA9548A (or PCA9548A) multiplexer. selected is the channel mask last
+//written to it, kept by the library (0xFF after a failed write), set it back
+//to 0 after resetting the mux.
+struct I2CMux
+{
+  uint8_t address;
+  uint8_t selected;
+};
+#endif
+
+//Bus phases of the TWI low-level methods, passed to I2C_PHASE_HOOK and
+//recorded by I2C_PROFILE, with I2C_PHASE_END or'ed in when the TWI is done
+#define I2C_PHASE_START 0x01
+#define I2C_PHASE_ADDRESS 0x02
+#define I2C_PHASE_SEND 0x03
+#define I2C_PHASE_RECEIVE 0x04
+#define I2C_PHASE_STOP 0x05
+#define I2C_PHASE_END 0x80
+
+//A build can set I2C_PHASE_HOOK(phase) to code run at every boundary, such
+//as a port write toggling a debug pin, or a call to i2cPhaseHook() defined
+//by the sketch
+#if defined(I2C_PHASE_HOOK)
+void i2cPhaseHook(uint8_t phase);
+#endif
+
+//Set to 1 to record TCNT1 at every phase boundary into a ring of
+//I2C_PROFILE_SIZE entries, read back with profile()
+#ifndef I2C_PROFILE
+#define I2C_PROFILE 0
+#endif
+#ifndef I2C_PROFILE_SIZE
+#define I2C_PROFILE_SIZE 32
+#endif
+#if I2C_PROFILE_SIZE > 255
+#error "I2C_PROFILE_SIZE can be at most 255 entries"
+#endif
+#if I2C_PROFILE && (I2C_BACKEND != I2C_BACKEND_TWI)
+#error "I2C_PROFILE times the TWI phases with Timer1, it is only available on the AVR"
+#endif
+
+#if I2C_PROFILE
+struct I2CProfileEntry
+{
+  uint8_t phase;
+  uint16_t ticks; //TCNT1, differences wrap like the timer
+};
+#endif
+
+//direction values for I2CTransaction, I2C_STOP may be or'ed in to force a
+//stop after the entry instead of a repeated start (e.g. EEPROM writes)
+#define I2C_WRITE 0x00
+#define I2C_READ 0x01
+#define I2C_STOP 0x80
+
+#if I2C_SAMPLER
+//One periodic read of the sampler, the first part is filled in by the sketch.
+//ring holds depth slots of numberBytes, one is always kept free so at most
+//depth - 1 samples are waiting. stamps (NULL if not wanted) holds the
+//micros() each slot was due at.
+struct I2CSampleJob
+{
+  uint8_t address;
+  uint8_t registerAddress;
+  uint8_t numberBytes;
+  uint16_t period; //in sampler ticks
+  uint8_t *ring;
+  uint32_t *stamps;
+  uint8_t depth;
+  //kept by the library
+  volatile uint8_t head;
+  volatile uint8_t tail;
+  volatile uint8_t overruns; //samples dropped, the ring was full or the bus still busy
+  uint8_t status;            //result of the last read
+  uint8_t due;
+  uint16_t countdown;
+  uint32_t dueStamp;
+};
+#endif
+
+//flags for _transfer()
+#define TRANSFER_STOP 0x01
+#define TRANSFER_REPEATED 0x02
+#define TRANSFER_FLASH 0x04 //txData is in PROGMEM
+#define TRANSFER_STREAM 0x08 //rxData is a chunk for streamCallback
+#define TRANSFER_BLOCK_WRITE 0x10 //a count byte goes before txData
+#define TRANSFER_BLOCK_READ 0x20 //the first byte read is the count
+#define TRANSFER_PEC 0x40 //the last byte is the SMBus packet error code
+#define TRANSFER_SMBUS (TRANSFER_BLOCK_WRITE | TRANSFER_BLOCK_READ | TRANSFER_PEC)
+
+//One entry of a batch for execute() or submit()
+struct I2CTransaction
+{
+  uint8_t address;
+  uint8_t registerAddress;
+  uint8_t direction;
+  uint8_t numberBytes;
+  uint8_t *dataBuffer;
+  uint8_t status; //result of this entry, filled in by the library
+};
+
+class I2C;
+template <uint8_t Address, uint8_t RegisterBytes, I2C &Bus>
+struct I2CDevice;
+template <typename Device, uint16_t Register, typename T = uint8_t, uint8_t SwapWidth = sizeof(T)>
+struct I2CRegister;
 
 class I2C
 {
 public:
-  I2C();
+  I2C(uint8_t = 0); //the TWI to drive, 1 for the TWI1 of an ATmega328PB
   void begin();
   void end();
   void timeOut(uint16_t);
+  void timeOutMicros(uint32_t);
+  void setRetries(uint8_t, uint16_t = 0, uint8_t = 0);
   void setSpeed(uint8_t);
+  uint32_t setClock(uint32_t);
+#if I2C_BACKEND == I2C_BACKEND_TWI
+  //Same as setClock() with TWBR and the prescaler worked out at compile time
+  template <uint32_t hz>
+  uint32_t setClock()
+  {
+    static_assert(hz <= F_CPU / 16, "I2C clock too fast for F_CPU");
+    static_assert(_clockTWBR(hz, _clockPrescaler(hz)) <= 0xFF, "I2C clock too slow for F_CPU");
+    _setClock(_clockTWBR(hz, _clockPrescaler(hz)), _clockPrescaler(hz));
+    return (_clockRate(_clockTWBR(hz, _clockPrescaler(hz)), _clockPrescaler(hz)));
+  }
+#else
+  template <uint32_t hz>
+  uint32_t setClock()
+  {
+    return (setClock(hz));
+  }
+#endif
   void pullup(uint8_t);
+  uint8_t recoverBus();
   void scan();
+  uint8_t scan(uint8_t *, uint32_t = 1000, uint8_t = 0, uint8_t = 0x7F); //fills a 16 byte bitmap
+  void setBuffer(uint8_t *, uint8_t);
+  template <size_t N>
+  void setBuffer(uint8_t (&buffer)[N])
+  {
+    static_assert(N <= 0xFF, "I2C buffer can be at most 255 bytes");
+    setBuffer(buffer, N);
+  }
+#if I2C_STATS
+  const I2CStats &stats();
+  void resetStats();
+#endif
+#if I2C_TRACE
+  uint8_t trace(I2CTraceEntry *, uint8_t); //oldest first
+  void resetTrace();
+  void dumpTrace(Print &);
+#endif
+#if I2C_PRESENCE
+  //NACKs in a row that make a device absent (0 turns it off) and the
+  //milliseconds between the tries that check whether it is back
+  void setPresence(uint8_t, uint16_t = 1000);
+  void resetPresence();
+  uint8_t absent(uint8_t);
+  uint8_t absentDevices(uint8_t *); //fills a 16 byte bitmap like scan()
+#endif
+#if I2C_MUX_DEVICES
+  //Returns the address to use for the device at address on channel of the
+  //mux, 0x80 for the first one added and so on, or 0 if the table is full
+  uint8_t addMuxDevice(I2CMux *, uint8_t, uint8_t);
+  void removeMuxDevices();
+#endif
+#if I2C_WRITE_CACHE
+  void invalidateCache(uint8_t); //forgets the registers of one device
+  void invalidateCache();
+#endif
+#if I2C_PROFILE
+  uint8_t profile(I2CProfileEntry *, uint8_t); //oldest first
+  void resetProfile();
+#endif
   uint8_t available();
   uint8_t receive();
   uint8_t write(uint8_t, uint8_t);
@@ -104,6 +543,10 @@ public:
   uint8_t write(uint8_t, uint8_t, uint32_t); //Will write 4 bytes
   uint8_t write(uint8_t, uint8_t, uint64_t); //Will write 8 bytes
   uint8_t write(uint8_t, uint8_t, const uint8_t *, uint8_t);
+#if (ARDUINO >= 100)
+  uint8_t write(uint8_t, uint8_t, const __FlashStringHelper *); //F("...") strings
+#endif
+  uint8_t write_P(uint8_t, uint8_t, const uint8_t *, uint16_t); //data in PROGMEM
   uint8_t read(uint8_t, uint8_t);
   uint8_t read(int, int);
   uint8_t read(uint8_t, uint8_t, uint8_t);
@@ -112,6 +555,28 @@ public:
   uint8_t readex(uint8_t, uint16_t, uint8_t *);//overload for more than 255 bytes
   uint8_t read(uint8_t, uint8_t, uint8_t, uint8_t *);
   uint8_t readex(uint8_t, uint8_t, uint16_t, uint8_t *);//overload for more than 255 bytes
+  //Reads numberBytes in one transaction through a small chunk buffer
+  uint8_t readStream(uint8_t, uint8_t, uint16_t, uint8_t *, uint8_t, I2CChunkCallback);
+  //Reads sizeof(T) bytes straight into dest, optionally reversing every
+  //swapWidth bytes (2 for a struct of big-endian 16-bit fields)
+  template <typename T>
+  uint8_t readInto(uint8_t address, uint8_t registerAddress, T &dest, uint8_t swapWidth = 0)
+  {
+    returnStatus = readex(address, registerAddress, sizeof(T), (uint8_t *)&dest);
+    _swapBytes((uint8_t *)&dest, sizeof(T), swapWidth);
+    return (returnStatus);
+  }
+  //Writes a command of any length, then reads the reply after a repeated
+  //start, in one transaction. A NULL rx reads into the internal buffer.
+  uint8_t transfer(uint8_t, const uint8_t *, uint16_t, uint8_t * = NULL, uint16_t = 0);
+#if I2C_SMBUS
+  void setPec(uint8_t); //append and check a PEC on the smbus*() calls
+  uint8_t smbusBlockWrite(uint8_t, uint8_t, const uint8_t *, uint8_t);
+  //The count sent by the slave goes to *count, data gets at most maxCount
+  uint8_t smbusBlockRead(uint8_t, uint8_t, uint8_t *, uint8_t, uint8_t * = NULL);
+  uint8_t smbusProcessCall(uint8_t, uint8_t, uint16_t, uint16_t *);
+  uint8_t smbusBlockProcessCall(uint8_t, uint8_t, const uint8_t *, uint8_t, uint8_t *, uint8_t, uint8_t * = NULL);
+#endif
 
   //These functions will be used to write to Slaves that take 16-bit addresses
   uint8_t write16(uint8_t, uint16_t);
@@ -121,9 +586,67 @@ public:
   uint8_t write16(uint8_t, uint16_t, uint32_t); //Will write 4 bytes
   uint8_t write16(uint8_t, uint16_t, uint64_t); //Will write 8 bytes
   uint8_t write16(uint8_t, uint16_t, const uint8_t *, uint8_t);
+#if (ARDUINO >= 100)
+  uint8_t write16(uint8_t, uint16_t, const __FlashStringHelper *);
+#endif
+  uint8_t write16_P(uint8_t, uint16_t, const uint8_t *, uint16_t);
   //These functions will be used to read from Slaves that take 16-bit addresses
   uint8_t read16(uint8_t, uint16_t, uint8_t);
   uint8_t read16(uint8_t, uint16_t, uint8_t, uint8_t *);
+  uint8_t read16ex(uint8_t, uint16_t, uint16_t, uint8_t *);//overload for more than 255 bytes
+  uint8_t readStream16(uint8_t, uint16_t, uint16_t, uint8_t *, uint8_t, I2CChunkCallback);
+  //Splits the write on page boundaries of 24Cxx style EEPROMs
+  uint8_t writeEeprom(uint8_t, uint16_t, const uint8_t *, uint16_t, uint16_t);
+  //Streams PROGMEM tables of {reg, value} pairs or {reg, length, bytes...} records
+  uint8_t writeTable(uint8_t, const uint8_t *, uint16_t);
+  uint8_t writeRecords(uint8_t, const uint8_t *, uint16_t);
+  template <typename T>
+  uint8_t read16Into(uint8_t address, uint16_t registerAddress, T &dest, uint8_t swapWidth = 0)
+  {
+    returnStatus = read16ex(address, registerAddress, sizeof(T), (uint8_t *)&dest);
+    _swapBytes((uint8_t *)&dest, sizeof(T), swapWidth);
+    return (returnStatus);
+  }
+
+  //Runs a batch of transactions back to back with repeated starts
+  uint8_t execute(I2CTransaction *, uint8_t);
+
+#if I2C_ASYNC
+  //Non-blocking transfers, the bus is driven from TWI_vect
+  uint8_t readAsync(uint8_t, uint8_t, uint8_t, uint8_t *, I2CCallback = NULL);
+  uint8_t writeAsync(uint8_t, uint8_t, const uint8_t *, uint8_t, I2CCallback = NULL);
+  uint8_t submit(I2CTransaction *, uint8_t, I2CCallback = NULL);
+  uint8_t poll();
+#endif
+
+#if I2C_BACKEND == I2C_BACKEND_HOST
+  void attachModel(I2CModel *);
+  void detachModels();
+  const I2CBusCounters &busCounters();
+  void resetBusCounters();
+#endif
+
+#if I2C_SAMPLER
+  //Reads every job each period ticks of Timer2, returns the actual tick
+  uint16_t beginSampler(I2CSampleJob *, uint8_t, uint16_t);
+  void endSampler();
+  uint8_t takeSample(I2CSampleJob *, uint8_t *, uint32_t * = NULL);
+#endif
+
+#if I2C_SLAVE
+  //Answers as a slave at address, serving reads from and storing writes in
+  //registers[], protect is an optional bitmap of read-only registers
+  void beginSlave(uint8_t, uint8_t *, uint8_t, const uint8_t * = NULL, I2CSlaveCallback = NULL);
+  void endSlave();
+#endif
+
+#if I2C_POLLED
+  //Non-blocking transfers moved on by calling service() from the main loop
+  uint8_t beginRead(uint8_t, uint8_t, uint8_t, uint8_t *);
+  uint8_t beginWrite(uint8_t, uint8_t, const uint8_t *, uint8_t);
+  uint8_t beginBatch(I2CTransaction *, uint8_t);
+  uint8_t service();
+#endif
 
   //Low-level methods
   uint8_t _start();
@@ -132,18 +655,262 @@ public:
   uint8_t _receiveByte(uint8_t);
   uint8_t _receiveByte(uint8_t, uint8_t *target);
   uint8_t _stop();
+#if I2C_ASYNC || I2C_POLLED
+  void _asyncStep(); //Called from TWI_vect or service()
+#endif
+#if I2C_SLAVE
+  void _slaveStep(); //Called from TWI_vect
+#endif
+#if I2C_SAMPLER
+  void _samplerTick(); //Called from TIMER2_COMPA_vect
+#endif
+#if I2C_ASYNC || I2C_SLAVE || I2C_SLEEP
+  void _twiInterrupt(); //Called from TWI_vect (TWI1_vect for bus 1)
+#endif
 
 private:
-  void lockUp();
+  template <uint8_t, uint8_t, I2C &>
+  friend struct I2CDevice;
+  template <typename, uint16_t, typename, uint8_t>
+  friend struct I2CRegister;
+#if I2C_BACKEND == I2C_BACKEND_TWI
+  //SCL = F_CPU / (16 + 2 * TWBR * 4^prescaler)
+  static constexpr uint32_t _clockCycles(uint32_t hz)
+  {
+    return ((F_CPU + hz - 1) / hz);
+  }
+  static constexpr uint32_t _clockTWBR(uint32_t hz, uint8_t prescaler)
+  {
+    return ((_clockCycles(hz) <= 16) ? 0 : (_clockCycles(hz) - 16 + (2UL << (2 * prescaler)) - 1) / (2UL << (2 * prescaler)));
+  }
+  static constexpr uint8_t _clockPrescaler(uint32_t hz, uint8_t prescaler = 0)
+  {
+    return (((prescaler == 3) || (_clockTWBR(hz, prescaler) <= 0xFF)) ? prescaler : _clockPrescaler(hz, prescaler + 1));
+  }
+  static constexpr uint32_t _clockRate(uint32_t bitRate, uint8_t prescaler)
+  {
+    return (F_CPU / (16 + (bitRate << (1 + 2 * prescaler))));
+  }
+  void _setClock(uint8_t, uint8_t);
+  uint8_t _twiStep(uint8_t);
+  void _lineLow(uint8_t);
+  void _lineRelease(uint8_t, uint8_t);
+  void _clockRelease(uint8_t);
+  uint8_t bus;
+#if I2C_SLEEP
+  volatile uint8_t sleepWaiting; //TWI_vect then only wakes _twiStep()
+#endif
+#elif I2C_BACKEND == I2C_BACKEND_SAMD
+  void _sercomEnable();
+  void _sercomCommand(uint8_t);
+  uint8_t _sercomWait(uint8_t);
+  uint8_t _sercomStatus(uint8_t);
+  void _dmaBegin();
+  uint8_t _dmaTransfer(const volatile void *, volatile void *, uint16_t, uint8_t, uint16_t);
+  uint8_t _dmaWrite(const uint8_t *, uint16_t);
+  uint8_t _dmaRead(uint8_t *, uint16_t);
+  uint32_t clockRate; //actual SCL rate, for the timeout budget
+  uint8_t baud;
+  uint8_t lastByte;  //the TWDR of the SERCOM, read by _receiveByte()
+  uint8_t rxPending; //a received byte is waiting to be read
+  uint8_t dmaReady;
+  uint8_t pullups;
+#endif
+#if I2C_BACKEND == I2C_BACKEND_HOST
+  void _busTime(uint8_t);
+  I2CModel *models;
+  I2CModel *current; //addressed by the last SLA+R/W, NULL once stopped
+  uint8_t reading;
+  uint8_t lastByte;
+  uint32_t clockRate;
+  I2CBusCounters counters;
+#endif
+  uint8_t _ackPoll(uint8_t);
+  static void _swapBytes(uint8_t *, uint16_t, uint8_t);
+  uint8_t _stream(uint8_t, uint16_t, uint8_t, uint16_t, uint8_t *, uint8_t, I2CChunkCallback);
+  void lockUp(uint8_t);
+  void _updateTimeOut();
+  uint8_t _retryable(uint8_t);
+  void _backoff(uint8_t);
+#if I2C_PRESENCE || I2C_MUX_DEVICES
+  uint8_t _failEarly(uint8_t, uint8_t);
+#endif
+  uint8_t _transfer(uint8_t, uint16_t, uint8_t, const uint8_t *, uint16_t, uint8_t *, uint16_t, uint8_t);
+  uint8_t _transferPhases(uint8_t, uint16_t, uint8_t, const uint8_t *, uint16_t, uint8_t *, uint16_t, uint8_t);
+#if I2C_SMBUS
+  uint8_t _smbusPhases(uint8_t, uint16_t, uint8_t, const uint8_t *, uint16_t, uint8_t *, uint16_t, uint8_t);
+  uint8_t _smbusSend(uint8_t, uint8_t *);
+  uint8_t smbusPec;
+  uint8_t smbusCount; //count byte of the last block read
+#endif
+#if I2C_STATS
+  void _countTransfer(uint8_t, uint16_t, uint32_t);
+  I2CStats statistics;
+#endif
+#if I2C_TRACE
+  void _traceTransfer(uint8_t, uint16_t, uint16_t, uint8_t);
+  I2CTraceEntry traceRing[I2C_TRACE_SIZE];
+  uint8_t traceHead;
+  uint8_t traceCount;
+#endif
+#if I2C_PRESENCE
+  uint8_t _presenceFind(uint8_t);
+  uint8_t _presenceSkip(uint8_t);
+  void _presenceUpdate(uint8_t, uint8_t);
+  uint8_t presenceAddress[I2C_PRESENCE];
+  uint8_t presenceNacks[I2C_PRESENCE]; //0 for an unused entry
+  uint8_t presenceStatus[I2C_PRESENCE]; //the NACK given, returned while absent
+  uint32_t presenceProbe[I2C_PRESENCE]; //millis() of the last try
+  uint8_t presenceLimit;
+  uint16_t presenceInterval;
+#endif
+#if I2C_MUX_DEVICES
+  uint8_t _muxRoute(uint8_t *, uint8_t *);
+  uint8_t _muxSelect(I2CMux *, uint8_t, uint8_t);
+  I2CMux *muxOf[I2C_MUX_DEVICES];
+  uint8_t muxChannel[I2C_MUX_DEVICES];
+  uint8_t muxAddress[I2C_MUX_DEVICES];
+  uint8_t muxCount;
+#endif
+#if I2C_WRITE_CACHE
+  uint8_t _cacheFind(uint8_t, uint8_t);
+  void _cacheStore(uint8_t, uint8_t, uint8_t, uint8_t);
+  void _cacheForget(uint8_t, uint8_t, uint16_t);
+  uint8_t cacheAddress[I2C_WRITE_CACHE]; //CACHE_FREE for an unused entry
+  uint8_t cacheRegister[I2C_WRITE_CACHE];
+  uint8_t cacheValue[I2C_WRITE_CACHE];
+  uint8_t cacheNext; //entry replaced when none is free
+#endif
+#if I2C_PROFILE
+  void _profileMark(uint8_t phase)
+  {
+    profileRing[profileHead].phase = phase;
+    profileRing[profileHead].ticks = TCNT1;
+    profileHead = (profileHead + 1 < I2C_PROFILE_SIZE) ? profileHead + 1 : 0;
+    if (profileCount < I2C_PROFILE_SIZE)
+    {
+      profileCount++;
+    }
+  }
+  I2CProfileEntry profileRing[I2C_PROFILE_SIZE];
+  uint8_t profileHead;
+  uint8_t profileCount;
+#endif
+#if I2C_ASYNC || I2C_POLLED
+  uint8_t _asyncSingle(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t *, I2CCallback, uint8_t);
+  uint8_t _asyncBegin(I2CTransaction *, uint8_t, I2CCallback, uint8_t);
+  void _asyncNext(uint8_t);
+  void _asyncFinish(uint8_t);
+  volatile uint8_t asyncStatus;
+  uint8_t asyncState;
+  uint8_t asyncIndex;
+  uint8_t asyncEntry;
+  uint8_t asyncCount;
+  uint8_t asyncResult;
+  I2CTransaction *asyncList;
+  I2CTransaction asyncSingle;
+  I2CCallback asyncCallback;
+  uint8_t asyncControl; //TWIE or 0
+#endif
+#if I2C_SAMPLER
+  static void _samplerDone(uint8_t);
+  void _samplerNext();
+  I2CSampleJob *samplerJobs;
+  uint8_t samplerCount;
+  uint8_t samplerActive; //job being read or SAMPLER_IDLE
+#endif
+#if I2C_SLAVE
+  uint8_t *slaveMap;
+  const uint8_t *slaveProtect;
+  uint8_t slaveSize;
+  uint8_t slavePointer;
+  uint8_t slaveState;
+  uint8_t slaveFirst;
+  uint8_t slaveCount;
+  I2CSlaveCallback slaveCallback;
+#endif
+  I2CChunkCallback streamCallback;
+  uint8_t streamChunk;
   uint8_t returnStatus;
-  uint8_t nack;
-  uint8_t data[MAX_BUFFER_SIZE];
-  static uint8_t bytesAvailable;
-  static uint8_t bufferIndex;
-  static uint8_t totalBytes;
-  static uint16_t timeOutDelay;
+  uint8_t *data;
+  uint8_t bufferSize;
+  uint8_t bytesAvailable;
+  uint8_t bufferIndex;
+  uint8_t totalBytes;
+  uint32_t timeOutDelay; //in microseconds
+  uint32_t timeOutSpins;
+  uint8_t retryAttempts; //including the first try
+  uint16_t retryBackoff; //in microseconds
+  uint8_t retryNack;
 };
 
 extern I2C I2c;
 
+//Compile-time device descriptors. The address and the register width (1 for
+//the usual 8-bit register map, 2 like read16()) are template arguments, so a
+//call is a single inlined _transfer() with no overloads picked at runtime:
+//
+//  typedef I2CDevice<0x1E> HMC5883L;
+//  HMC5883L::read(0x03, buffer, 6);
+//
+//A third argument puts the device on another instance than I2c.
+template <uint8_t Address, uint8_t RegisterBytes = 1, I2C &Bus = I2c>
+struct I2CDevice
+{
+  //0x80 and up are the handles of addMuxDevice()
+  static_assert((Address <= 0x7F) || I2C_MUX_DEVICES, "I2C addresses are 7 bits");
+  static_assert((RegisterBytes == 1) || (RegisterBytes == 2), "register addresses are 1 or 2 bytes");
+  static const uint8_t address = Address;
+  static const uint8_t registerBytes = RegisterBytes;
+
+  static uint8_t write(uint16_t registerAddress, const uint8_t *data, uint16_t numberBytes)
+  {
+    return (Bus._transfer(Address, registerAddress, RegisterBytes, data, numberBytes, NULL, 0, TRANSFER_STOP));
+  }
+  static uint8_t write(uint16_t registerAddress, uint8_t data)
+  {
+    return (write(registerAddress, &data, 1));
+  }
+  static uint8_t read(uint16_t registerAddress, uint8_t *dataBuffer, uint16_t numberBytes)
+  {
+    return (Bus._transfer(Address, registerAddress, RegisterBytes, NULL, 0, dataBuffer, numberBytes, TRANSFER_STOP));
+  }
+};
+
+//A register of Device holding a T. Every SwapWidth bytes are reversed on the
+//way in and out, the default of sizeof(T) is a scalar sent MSB first as most
+//sensors do, 2 suits an array or struct of big-endian 16-bit fields and 1
+//leaves the bytes as they are on the bus:
+//
+//  typedef I2CRegister<HMC5883L, 0x03, int16_t[3], 2> HMC5883L_DATA;
+//  int16_t field[3];
+//  HMC5883L_DATA::read(field);
+template <typename Device, uint16_t Register, typename T, uint8_t SwapWidth>
+struct I2CRegister
+{
+  static_assert((Device::registerBytes == 2) || (Register <= 0xFF), "register address too wide for the device");
+  static_assert((SwapWidth <= 1) || (sizeof(T) % SwapWidth == 0), "sizeof(T) must be a multiple of SwapWidth");
+
+  static uint8_t read(T &value)
+  {
+    uint8_t status = Device::read(Register, (uint8_t *)&value, sizeof(T));
+    if (SwapWidth > 1)
+    {
+      I2C::_swapBytes((uint8_t *)&value, sizeof(T), SwapWidth);
+    }
+    return (status);
+  }
+  static uint8_t write(const T &value)
+  {
+    if (SwapWidth <= 1)
+    {
+      return (Device::write(Register, (const uint8_t *)&value, sizeof(T)));
+    }
+    T buffer;
+    memcpy(&buffer, &value, sizeof(T));
+    I2C::_swapBytes((uint8_t *)&buffer, sizeof(T), SwapWidth);
+    return (Device::write(Register, (const uint8_t *)&buffer, sizeof(T)));
+  }
+};
+
 #endif
@@ -0,0 +1,118 @@
+/*******************************************
+ Times read(), write() and read16() calls.
+
+ On a board it runs them against the device
+ at DEVICE and prints the microseconds per
+ call.
+
+ It also builds on a PC against simulated
+ slaves, no hardware needed:
+
+   g++ -DI2C_HOST=1 -I. -x c++ examples/Benchmark/Benchmark.ino I2C.cpp -o benchmark
+
+ There it prints the bus bits, low-level steps
+ and bus time of each call, which are exact and
+ the same on every run, plus the host CPU time
+ per call to spot regressions in the library
+ code itself.
+ *******************************************/
+
+#include <I2C.h>
+
+#define DEVICE 0x1E
+#define EEPROM 0x50
+#define RUNS 1000
+
+uint8_t buffer[32];
+
+#if I2C_HOST
+#include <time.h>
+
+uint8_t registers[256];
+uint8_t eeprom[4096];
+I2CModel sensor = {DEVICE, 1, registers, sizeof(registers), 0, NULL, NULL, 0, 0, NULL};
+I2CModel memory = {EEPROM, 2, eeprom, sizeof(eeprom), 0, NULL, NULL, 0, 0, NULL};
+
+uint64_t hostNanos()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+#endif
+
+void report(const char *name, uint8_t status, unsigned long busMicros)
+{
+#if I2C_HOST
+  const I2CBusCounters &counters = I2c.busCounters();
+  printf("%-24s status %3u  %5lu bits  %4lu steps  %6lu us on the bus",
+         name, status, (unsigned long)counters.bits / RUNS, (unsigned long)counters.steps / RUNS, busMicros / RUNS);
+#else
+  Serial.print(name);
+  Serial.print(F(" status "));
+  Serial.print(status);
+  Serial.print(F("  "));
+  Serial.print(busMicros / RUNS);
+  Serial.println(F(" us"));
+#endif
+}
+
+#if I2C_HOST
+#define BENCH(name, call)                                                 \
+  {                                                                       \
+    uint8_t status = 0;                                                   \
+    I2c.resetBusCounters();                                               \
+    unsigned long start = micros();                                       \
+    uint64_t cpuStart = hostNanos();                                      \
+    for (int i = 0; i < RUNS; i++)                                        \
+    {                                                                     \
+      status = call;                                                      \
+    }                                                                     \
+    uint64_t cpu = hostNanos() - cpuStart;                                \
+    report(name, status, micros() - start);                               \
+    printf("  %6.1f ns host CPU\n", (double)cpu / RUNS);                  \
+  }
+#else
+#define BENCH(name, call)                                                 \
+  {                                                                       \
+    uint8_t status = 0;                                                   \
+    unsigned long start = micros();                                       \
+    for (int i = 0; i < RUNS; i++)                                        \
+    {                                                                     \
+      status = call;                                                      \
+    }                                                                     \
+    report(name, status, micros() - start);                               \
+  }
+#endif
+
+void setup()
+{
+#if I2C_HOST
+  I2c.attachModel(&sensor);
+  I2c.attachModel(&memory);
+#else
+  Serial.begin(9600);
+#endif
+  I2c.begin();
+  I2c.setSpeed(1);
+
+  BENCH("write 1 byte", I2c.write(DEVICE, 0x02, 0x00));
+  BENCH("write 8 bytes", I2c.write(DEVICE, 0x10, buffer, 8));
+  BENCH("read 1 byte", I2c.read(DEVICE, 0x03, 1, buffer));
+  BENCH("read 6 bytes", I2c.read(DEVICE, 0x03, 6, buffer));
+  BENCH("read 6 bytes, buffered", I2c.read(DEVICE, 0x03, 6));
+  BENCH("read16 16 bytes", I2c.read16(EEPROM, 0x0100, 16, buffer));
+  BENCH("read, no device", I2c.read(0x7E, 0x00, 1, buffer));
+}
+
+void loop()
+{
+}
+
+#if I2C_HOST
+int main()
+{
+  setup();
+  return (0);
+}
+#endif